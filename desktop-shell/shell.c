@@ -1584,9 +1584,8 @@ move_grab_motion(struct weston_pointer_grab *grab, uint32_t time,
 
 	weston_view_set_position(shsurf->view, cx, cy);
 
-	WESTON_PLUGIN_CALL(shsurf->surface->compositor, move_notify,
-				shsurf->view,
-				wl_fixed_to_int(x),
+	WESTON_PLUGIN_CALL_VIEW(shsurf->surface->compositor, move_notify,
+				shsurf->view, wl_fixed_to_int(x),
 				wl_fixed_to_int(y));
 
 	weston_compositor_schedule_repaint(shsurf->surface->compositor);
@@ -1598,13 +1597,14 @@ move_grab_button(struct weston_pointer_grab *grab,
 {
 	struct shell_grab *shell_grab = container_of(grab, struct shell_grab,
 						    grab);
+	struct shell_surface *shsurf = shell_grab->shsurf;
 	struct weston_pointer *pointer = grab->pointer;
 	enum wl_pointer_button_state state = state_w;
 
 	if (pointer->button_count == 0 &&
 	    state == WL_POINTER_BUTTON_STATE_RELEASED) {
-		WESTON_PLUGIN_CALL(shell_grab->shsurf->surface->compositor,
-				ungrab_notify, shell_grab->shsurf->view);
+		WESTON_PLUGIN_CALL_VIEW(shsurf->surface->compositor,
+					ungrab_notify, shsurf->view);
 		shell_grab_end(shell_grab);
 		free(grab);
 	}
@@ -1615,9 +1615,10 @@ move_grab_cancel(struct weston_pointer_grab *grab)
 {
 	struct shell_grab *shell_grab =
 		container_of(grab, struct shell_grab, grab);
+	struct shell_surface *shsurf = shell_grab->shsurf;
 
-	WESTON_PLUGIN_CALL(shell_grab->shsurf->surface->compositor,
-			ungrab_notify, shell_grab->shsurf->view);
+	WESTON_PLUGIN_CALL_VIEW(shsurf->surface->compositor, ungrab_notify,
+				shsurf->view);
 	shell_grab_end(shell_grab);
 	free(grab);
 }
@@ -1655,7 +1656,7 @@ surface_move(struct shell_surface *shsurf, struct weston_seat *seat,
 	shell_grab_start(&move->base, &move_grab_interface, shsurf,
 			 seat->pointer, DESKTOP_SHELL_CURSOR_MOVE);
 
-	WESTON_PLUGIN_CALL(seat->compositor, grab_notify,
+	WESTON_PLUGIN_CALL_VIEW(seat->compositor, grab_notify,
 				shsurf->view,
 				wl_fixed_to_int(seat->pointer->grab_x),
 				wl_fixed_to_int(seat->pointer->grab_y));
@@ -5185,7 +5186,8 @@ shell_surface_configure(struct weston_surface *es, int32_t sx, int32_t sy)
 			  shsurf->view->geometry.y + to_y - from_y);
 	}
 
-	WESTON_PLUGIN_CALL(es->compositor, resize_notify, shsurf->view);
+	WESTON_PLUGIN_CALL_VIEW(es->compositor, resize_notify,
+				shsurf->view);
 }
 
 static void launch_desktop_shell_process(void *data);
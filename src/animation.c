@@ -26,6 +26,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -114,6 +115,33 @@ weston_spring_done(struct weston_spring *spring)
 		fabs(spring->current - spring->target) < 0.002;
 }
 
+WL_EXPORT uint32_t
+weston_compositor_get_animation_time(struct weston_compositor *ec)
+{
+	struct timespec ts;
+
+	if (ec->animation_clock)
+		return ec->animation_clock(ec->animation_clock_data);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Replaces the clock animations are stepped by, so they can be driven
+ * frame by frame with made up timestamps. A NULL clock restores the
+ * monotonic clock. Running animations see the jump, set the clock
+ * before starting any.
+ */
+WL_EXPORT void
+weston_compositor_set_animation_clock(struct weston_compositor *ec,
+				      weston_animation_clock_func_t clock,
+				      void *data)
+{
+	ec->animation_clock = clock;
+	ec->animation_clock_data = data;
+}
+
 typedef	void (*weston_view_animation_frame_func_t)(struct weston_view_animation *animation);
 
 struct weston_view_animation {
@@ -461,5 +489,7 @@ weston_move_scale_run(struct weston_view *view, int dx, int dy,
 	weston_spring_init(&animation->spring, 400.0, start, end);
 	animation->spring.friction = 1150;
 
+	weston_view_animation_run(animation);
+
 	return animation;
 }
@@ -24,16 +24,33 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 #include "compositor.h"
+#include "../shared/os-compatibility.h"
+
+/* Selections are read into memory until they grow past spill_size, from
+ * then on they live in an anonymous file and readers are served from it
+ * with sendfile(), so a large selection costs the compositor at most a
+ * pipe worth of buffering on top of the file itself.
+ */
+#define CLIPBOARD_READ_SIZE	4096
+#define CLIPBOARD_SPLICE_SIZE	65536
 
 struct clipboard_source {
 	struct weston_data_source base;
-	struct wl_array contents;
+	struct wl_array contents;	/* until spilled */
+	int spill_fd;			/* -1 while held in contents */
+	off_t size;
+	off_t max_size;			/* 0 for no limit */
+	int error;
+	struct wl_list client_list;
 	struct clipboard *clipboard;
 	struct wl_event_source *event_source;
 	uint32_t serial;
@@ -41,11 +58,29 @@ struct clipboard_source {
 	int fd;
 };
 
+struct clipboard_limit {
+	struct wl_list link;
+	char *mime_type;		/* full type, or a type/wildcard */
+	off_t max_size;
+};
+
 struct clipboard {
 	struct weston_seat *seat;
 	struct wl_listener selection_listener;
 	struct wl_listener destroy_listener;
 	struct clipboard_source *source;
+	off_t spill_size;
+	off_t max_size;
+	struct wl_list limit_list;
+};
+
+struct clipboard_client {
+	struct wl_event_source *event_source;
+	struct wl_list link;		/* clipboard_source::client_list */
+	off_t offset;
+	int waiting;
+	int fd;
+	struct clipboard_source *source;
 };
 
 static void clipboard_client_create(struct clipboard_source *source, int fd);
@@ -63,6 +98,8 @@ clipboard_source_unref(struct clipboard_source *source)
 		wl_event_source_remove(source->event_source);
 		close(source->fd);
 	}
+	if (source->spill_fd >= 0)
+		close(source->spill_fd);
 	wl_signal_emit(&source->base.destroy_signal,
 		       &source->base);
 	s = source->base.mime_types.data;
@@ -72,31 +109,176 @@ clipboard_source_unref(struct clipboard_source *source)
 	free(source);
 }
 
+static void
+clipboard_source_wake_clients(struct clipboard_source *source)
+{
+	struct clipboard_client *client;
+
+	wl_list_for_each(client, &source->client_list, link) {
+		if (!client->waiting)
+			continue;
+		wl_event_source_fd_update(client->event_source,
+					  WL_EVENT_WRITABLE);
+		client->waiting = 0;
+	}
+}
+
+static void
+clipboard_source_finish(struct clipboard_source *source, int error)
+{
+	wl_event_source_remove(source->event_source);
+	close(source->fd);
+	source->event_source = NULL;
+	source->error = error;
+	clipboard_source_wake_clients(source);
+}
+
+static int
+write_all(int fd, const char *p, size_t size)
+{
+	ssize_t len;
+
+	while (size > 0) {
+		len = write(fd, p, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return -1;
+		p += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+static int
+clipboard_create_spill_file(off_t size)
+{
+	int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("weston-clipboard", MFD_CLOEXEC);
+	if (fd >= 0)
+		return fd;
+#endif
+
+	/* Only the first size bytes are ever read back, so the file may be
+	 * larger than the selection. */
+	if (size < CLIPBOARD_READ_SIZE)
+		size = CLIPBOARD_READ_SIZE;
+
+	return os_create_anonymous_file(size);
+}
+
+/* Moves the contents read so far to an anonymous file, the rest of the
+ * selection is spliced straight from the pipe to that file.
+ */
+static int
+clipboard_source_spill(struct clipboard_source *source)
+{
+	int fd;
+
+	fd = clipboard_create_spill_file(source->contents.size);
+	if (fd < 0) {
+		weston_log("clipboard: failed to create spill file: %m\n");
+		return -1;
+	}
+
+	if (write_all(fd, source->contents.data, source->contents.size) < 0) {
+		weston_log("clipboard: failed to spill selection: %m\n");
+		close(fd);
+		return -1;
+	}
+
+	wl_array_release(&source->contents);
+	wl_array_init(&source->contents);
+	source->spill_fd = fd;
+
+	return 0;
+}
+
+static ssize_t
+clipboard_source_read(struct clipboard_source *source, int fd)
+{
+	char buffer[CLIPBOARD_READ_SIZE];
+	ssize_t len;
+	char *p;
+
+	if (source->spill_fd < 0) {
+		if (source->contents.alloc - source->contents.size <
+		    CLIPBOARD_READ_SIZE) {
+			if (!wl_array_add(&source->contents,
+					  CLIPBOARD_READ_SIZE))
+				return -1;
+			source->contents.size -= CLIPBOARD_READ_SIZE;
+		}
+
+		p = (char *) source->contents.data + source->contents.size;
+		len = read(fd, p, CLIPBOARD_READ_SIZE);
+		if (len > 0)
+			source->contents.size += len;
+
+		return len;
+	}
+
+	len = splice(fd, NULL, source->spill_fd, NULL, CLIPBOARD_SPLICE_SIZE,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (len >= 0 || errno != EINVAL)
+		return len;
+
+	/* The spill file does not take splice, copy through a buffer. */
+	len = read(fd, buffer, sizeof buffer);
+	if (len > 0 && write_all(source->spill_fd, buffer, len) < 0)
+		return -1;
+
+	return len;
+}
+
 static int
 clipboard_source_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_source *source = data;
 	struct clipboard *clipboard = source->clipboard;
-	char *p;
-	int len, size;
-
-	if (source->contents.alloc - source->contents.size < 1024) {
-		wl_array_add(&source->contents, 1024);
-		source->contents.size -= 1024;
+	char **mime_type = source->base.mime_types.data;
+	ssize_t len;
+
+	if (source->spill_fd < 0 &&
+	    source->contents.size >= (size_t) clipboard->spill_size &&
+	    clipboard_source_spill(source) < 0) {
+		clipboard_source_finish(source, 1);
+		goto err;
 	}
 
-	p = source->contents.data + source->contents.size;
-	size = source->contents.alloc - source->contents.size;
-	len = read(fd, p, size);
+	len = clipboard_source_read(source, fd);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+
 	if (len == 0) {
-		wl_event_source_remove(source->event_source);
-		close(fd);
-		source->event_source = NULL;
+		clipboard_source_finish(source, 0);
+		return 1;
 	} else if (len < 0) {
-		clipboard_source_unref(source);
+		clipboard_source_finish(source, 1);
+		goto err;
+	}
+
+	source->size += len;
+	if (source->max_size && source->size > source->max_size) {
+		weston_log("clipboard: dropping %s selection larger than "
+			   "%jd bytes\n", *mime_type,
+			   (intmax_t) source->max_size);
+		clipboard_source_finish(source, 1);
+		goto err;
+	}
+
+	clipboard_source_wake_clients(source);
+
+	return 1;
+
+ err:
+	/* A replaced selection is only kept alive by its readers. */
+	if (clipboard->source == source) {
 		clipboard->source = NULL;
-	} else {
-		source->contents.size += len;
+		clipboard_source_unref(source);
 	}
 
 	return 1;
@@ -128,6 +310,25 @@ clipboard_source_cancel(struct weston_data_source *source)
 {
 }
 
+static off_t
+clipboard_max_size(struct clipboard *clipboard, const char *mime_type)
+{
+	struct clipboard_limit *limit;
+	size_t len;
+
+	wl_list_for_each(limit, &clipboard->limit_list, link) {
+		len = strlen(limit->mime_type);
+		if (len > 2 && strcmp(limit->mime_type + len - 2, "/*") == 0) {
+			if (strncmp(limit->mime_type, mime_type, len - 1) == 0)
+				return limit->max_size;
+		} else if (strcmp(limit->mime_type, mime_type) == 0) {
+			return limit->max_size;
+		}
+	}
+
+	return clipboard->max_size;
+}
+
 static struct clipboard_source *
 clipboard_source_create(struct clipboard *clipboard,
 			const char *mime_type, uint32_t serial, int fd)
@@ -137,12 +338,13 @@ clipboard_source_create(struct clipboard *clipboard,
 	struct clipboard_source *source;
 	char **s;
 
-	source = malloc(sizeof *source);
+	source = zalloc(sizeof *source);
 	if (source == NULL)
 		return NULL;
 
 	wl_array_init(&source->contents);
 	wl_array_init(&source->base.mime_types);
+	wl_list_init(&source->client_list);
 	source->base.resource = NULL;
 	source->base.accept = clipboard_source_accept;
 	source->base.send = clipboard_source_send;
@@ -151,6 +353,9 @@ clipboard_source_create(struct clipboard *clipboard,
 	source->refcount = 1;
 	source->clipboard = clipboard;
 	source->serial = serial;
+	source->fd = fd;
+	source->spill_fd = -1;
+	source->max_size = clipboard_max_size(clipboard, mime_type);
 
 	s = wl_array_add(&source->base.mime_types, sizeof *s);
 	if (s == NULL)
@@ -176,33 +381,81 @@ clipboard_source_create(struct clipboard *clipboard,
 	return NULL;
 }
 
-struct clipboard_client {
-	struct wl_event_source *event_source;
-	size_t offset;
-	struct clipboard_source *source;
-};
+static void
+clipboard_client_destroy(struct clipboard_client *client)
+{
+	close(client->fd);
+	wl_event_source_remove(client->event_source);
+	wl_list_remove(&client->link);
+	clipboard_source_unref(client->source);
+	free(client);
+}
+
+static ssize_t
+clipboard_client_send_file(struct clipboard_client *client, size_t size)
+{
+	struct clipboard_source *source = client->source;
+	char buffer[CLIPBOARD_READ_SIZE];
+	off_t offset = client->offset;
+	ssize_t len;
+
+	len = sendfile(client->fd, source->spill_fd, &offset, size);
+	if (len >= 0 || (errno != EINVAL && errno != ENOSYS))
+		return len;
+
+	if (size > sizeof buffer)
+		size = sizeof buffer;
+	len = pread(source->spill_fd, buffer, size, client->offset);
+	if (len <= 0)
+		return -1;
+
+	return write(client->fd, buffer, len);
+}
 
 static int
 clipboard_client_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_client *client = data;
-	char *p;
+	struct clipboard_source *source = client->source;
 	size_t size;
-	int len;
+	char *p;
+	ssize_t len;
 
-	size = client->source->contents.size;
-	p = client->source->contents.data;
-	len = write(fd, p + client->offset, size - client->offset);
-	if (len > 0)
-		client->offset += len;
+	if (source->error || (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR)))
+		goto done;
 
-	if (client->offset == size || len <= 0) {
-		close(fd);
-		wl_event_source_remove(client->event_source);
-		clipboard_source_unref(client->source);
-		free(client);
+	if (client->offset < source->size) {
+		size = source->size - client->offset;
+		if (source->spill_fd >= 0) {
+			len = clipboard_client_send_file(client, size);
+		} else {
+			p = source->contents.data;
+			len = write(fd, p + client->offset, size);
+		}
+
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return 1;
+		if (len <= 0)
+			goto done;
+
+		client->offset += len;
+		if (client->offset < source->size)
+			return 1;
 	}
 
+	if (source->event_source == NULL)
+		goto done;
+
+	/* Caught up with a selection still being read, sleep until the
+	 * source has more for us. */
+	wl_event_source_fd_update(client->event_source, 0);
+	client->waiting = 1;
+
+	return 1;
+
+ done:
+	clipboard_client_destroy(client);
+
 	return 1;
 }
 
@@ -213,15 +466,33 @@ clipboard_client_create(struct clipboard_source *source, int fd)
 	struct clipboard_client *client;
 	struct wl_event_loop *loop =
 		wl_display_get_event_loop(seat->compositor->wl_display);
+	int flags;
 
-	client = malloc(sizeof *client);
+	client = zalloc(sizeof *client);
+	if (client == NULL) {
+		close(fd);
+		return;
+	}
+
+	/* Never block the compositor on a slow reader. */
+	flags = fcntl(fd, F_GETFL);
+	if (flags != -1)
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
+	client->fd = fd;
 	client->offset = 0;
 	client->source = source;
-	source->refcount++;
 	client->event_source =
 		wl_event_loop_add_fd(loop, fd, WL_EVENT_WRITABLE,
 				     clipboard_client_data, client);
+	if (client->event_source == NULL) {
+		close(fd);
+		free(client);
+		return;
+	}
+
+	source->refcount++;
+	wl_list_insert(&source->client_list, &client->link);
 }
 
 static void
@@ -272,12 +543,74 @@ clipboard_destroy(struct wl_listener *listener, void *data)
 	struct clipboard *clipboard =
 		container_of(listener, struct clipboard, destroy_listener);
 
+	struct clipboard_limit *limit, *next;
+
+	if (clipboard->source) {
+		if (clipboard->source->event_source)
+			clipboard_source_finish(clipboard->source, 1);
+		clipboard_source_unref(clipboard->source);
+	}
+
+	wl_list_for_each_safe(limit, next, &clipboard->limit_list, link) {
+		free(limit->mime_type);
+		free(limit);
+	}
+
 	wl_list_remove(&clipboard->selection_listener.link);
 	wl_list_remove(&clipboard->destroy_listener.link);
 
 	free(clipboard);
 }
 
+/* A [clipboard] section without mime-type sets the defaults, one with
+ * a mime-type sets the size limit for that type. Sizes are in KiB.
+ */
+static void
+clipboard_configure(struct clipboard *clipboard, struct weston_config *config)
+{
+	struct weston_config_section *section = NULL;
+	struct clipboard_limit *limit;
+	const char *section_name;
+	char *mime_type;
+	uint32_t size;
+
+	clipboard->spill_size = 64 * 1024;
+	clipboard->max_size = 128 * 1024 * 1024;
+
+	while (weston_config_next_section(config, &section, &section_name)) {
+		if (strcmp(section_name, "clipboard") != 0)
+			continue;
+
+		weston_config_section_get_string(section, "mime-type",
+						 &mime_type, NULL);
+		if (mime_type == NULL) {
+			weston_config_section_get_uint(section, "spill-size",
+						       &size, 64);
+			clipboard->spill_size = (off_t) size * 1024;
+			weston_config_section_get_uint(section, "max-size",
+						       &size, 128 * 1024);
+			clipboard->max_size = (off_t) size * 1024;
+			continue;
+		}
+
+		if (weston_config_section_get_uint(section, "max-size",
+						   &size, 0) < 0) {
+			free(mime_type);
+			continue;
+		}
+
+		limit = zalloc(sizeof *limit);
+		if (limit == NULL) {
+			free(mime_type);
+			continue;
+		}
+
+		limit->mime_type = mime_type;
+		limit->max_size = (off_t) size * 1024;
+		wl_list_insert(clipboard->limit_list.prev, &limit->link);
+	}
+}
+
 struct clipboard *
 clipboard_create(struct weston_seat *seat)
 {
@@ -288,6 +621,8 @@ clipboard_create(struct weston_seat *seat)
 		return NULL;
 
 	clipboard->seat = seat;
+	wl_list_init(&clipboard->limit_list);
+	clipboard_configure(clipboard, seat->compositor->config);
 	clipboard->selection_listener.notify = clipboard_set_selection;
 	clipboard->destroy_listener.notify = clipboard_destroy;
 
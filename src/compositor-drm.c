@@ -1595,7 +1595,7 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 			goto err;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base, 0) < 0)
 		goto err;
 
 	pixman_region32_init_rect(&output->previous_damage,
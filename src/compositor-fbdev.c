@@ -623,7 +623,8 @@ fbdev_output_create(struct fbdev_compositor *compositor,
 		pixman_image_set_transform(output->shadow_surface, &transform);
 
 	if (compositor->use_pixman) {
-		if (pixman_renderer_output_create(&output->base) < 0)
+		if (pixman_renderer_output_create(&output->base,
+						  PIXMAN_RENDERER_OUTPUT_DIRECT) < 0)
 			goto out_shadow_surface;
 	} else {
 		setenv("HYBRIS_EGLPLATFORM", "wayland", 1);
@@ -25,39 +25,31 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 
 #include "compositor.h"
+#include "pixman-renderer.h"
 
 struct headless_compositor {
 	struct weston_compositor base;
 	struct weston_seat fake_seat;
+	int use_pixman;
 };
 
 struct headless_output {
 	struct weston_output base;
 	struct weston_mode mode;
-	struct wl_event_source *finish_frame_timer;
+	struct weston_frame_timer frame_timer;
+	uint32_t *image_buf;
+	pixman_image_t *image;
 };
 
 
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_start_repaint_loop(struct weston_output *output_base)
 {
-	uint32_t msec;
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-	msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-	weston_output_finish_frame(output, msec);
-}
-
-static int
-finish_frame_handler(void *data)
-{
-	headless_output_start_repaint_loop(data);
+	struct headless_output *output = (struct headless_output *) output_base;
 
-	return 1;
+	weston_frame_timer_finish_frame(&output->frame_timer);
 }
 
 static int
@@ -72,7 +64,7 @@ headless_output_repaint(struct weston_output *output_base,
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	weston_frame_timer_schedule(&output->frame_timer);
 
 	return 0;
 }
@@ -81,8 +73,18 @@ static void
 headless_output_destroy(struct weston_output *output_base)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+
+	weston_frame_timer_release(&output->frame_timer);
+
+	if (c->use_pixman) {
+		pixman_renderer_output_destroy(&output->base);
+		pixman_image_unref(output->image);
+		free(output->image_buf);
+	}
 
-	wl_event_source_remove(output->finish_frame_timer);
+	weston_output_destroy(&output->base);
 	free(output);
 
 	return;
@@ -90,10 +92,9 @@ headless_output_destroy(struct weston_output *output_base)
 
 static int
 headless_compositor_create_output(struct headless_compositor *c,
-				 int width, int height)
+				 int width, int height, int refresh)
 {
 	struct headless_output *output;
-	struct wl_event_loop *loop;
 
 	output = zalloc(sizeof *output);
 	if (output == NULL)
@@ -103,7 +104,7 @@ headless_compositor_create_output(struct headless_compositor *c,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = width;
 	output->mode.height = height;
-	output->mode.refresh = 60;
+	output->mode.refresh = refresh;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
@@ -114,10 +115,6 @@ headless_compositor_create_output(struct headless_compositor *c,
 	output->base.make = "weston";
 	output->base.model = "headless";
 
-	loop = wl_display_get_event_loop(c->base.wl_display);
-	output->finish_frame_timer =
-		wl_event_loop_add_timer(loop, finish_frame_handler, output);
-
 	output->base.start_repaint_loop = headless_output_start_repaint_loop;
 	output->base.repaint = headless_output_repaint;
 	output->base.destroy = headless_output_destroy;
@@ -128,7 +125,42 @@ headless_compositor_create_output(struct headless_compositor *c,
 
 	wl_list_insert(c->base.output_list.prev, &output->base.link);
 
+	if (weston_frame_timer_init(&output->frame_timer,
+				    &output->base, refresh) < 0)
+		goto err_output;
+
+	if (c->use_pixman) {
+		output->image_buf = malloc(width * height * 4);
+		if (!output->image_buf)
+			goto err_timer;
+
+		output->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							 width, height,
+							 output->image_buf,
+							 width * 4);
+		if (!output->image)
+			goto err_buf;
+
+		if (pixman_renderer_output_create(&output->base,
+					PIXMAN_RENDERER_OUTPUT_DIRECT) < 0)
+			goto err_image;
+
+		pixman_renderer_output_set_buffer(&output->base,
+						  output->image);
+	}
+
 	return 0;
+
+err_image:
+	pixman_image_unref(output->image);
+err_buf:
+	free(output->image_buf);
+err_timer:
+	weston_frame_timer_release(&output->frame_timer);
+err_output:
+	weston_output_destroy(&output->base);
+	free(output);
+	return -1;
 }
 
 static int
@@ -168,7 +200,8 @@ headless_destroy(struct weston_compositor *ec)
 
 static struct weston_compositor *
 headless_compositor_create(struct wl_display *display,
-			   int width, int height, const char *display_name,
+			   int width, int height, int refresh, int use_pixman,
+			   const char *display_name,
 			   int *argc, char *argv[],
 			   struct weston_config *config)
 {
@@ -178,6 +211,8 @@ headless_compositor_create(struct wl_display *display,
 	if (c == NULL)
 		return NULL;
 
+	c->use_pixman = use_pixman;
+
 	if (weston_compositor_init(&c->base, display, argc, argv, config) < 0)
 		goto err_free;
 
@@ -187,10 +222,16 @@ headless_compositor_create(struct wl_display *display,
 	c->base.destroy = headless_destroy;
 	c->base.restore = headless_restore;
 
-	if (headless_compositor_create_output(c, width, height) < 0)
-		goto err_input;
+	/* The pixman renderer must exist before its outputs */
+	if (c->use_pixman) {
+		if (pixman_renderer_init(&c->base) < 0)
+			goto err_input;
+	} else {
+		if (noop_renderer_init(&c->base) < 0)
+			goto err_input;
+	}
 
-	if (noop_renderer_init(&c->base) < 0)
+	if (headless_compositor_create_output(c, width, height, refresh) < 0)
 		goto err_input;
 
 	return &c->base;
@@ -208,17 +249,30 @@ WL_EXPORT struct weston_compositor *
 backend_init(struct wl_display *display, int *argc, char *argv[],
 	     struct weston_config *config)
 {
+	struct weston_config_section *section;
 	int width = 1024, height = 640;
+	int refresh_rate;
+	int use_pixman = 0;
 	char *display_name = NULL;
 
 	const struct weston_option headless_options[] = {
 		{ WESTON_OPTION_INTEGER, "width", 0, &width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &height },
+		{ WESTON_OPTION_INTEGER, "refresh-rate", 0, &refresh_rate },
+		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &use_pixman },
 	};
 
+	section = weston_config_get_section(config, "core", NULL, NULL);
+	weston_config_section_get_int(section, "refresh-rate",
+				      &refresh_rate, 60);
+
 	parse_options(headless_options,
 		      ARRAY_LENGTH(headless_options), argc, argv);
 
-	return headless_compositor_create(display, width, height, display_name,
-					  argc, argv, config);
+	if (refresh_rate < 0)
+		refresh_rate = 60;
+
+	return headless_compositor_create(display, width, height,
+					  refresh_rate * 1000, use_pixman,
+					  display_name, argc, argv, config);
 }
@@ -25,7 +25,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <linux/input.h>
+#include <linux/sockios.h>
 
 #if HAVE_FREERDP_VERSION_H
 #include <freerdp/version.h>
@@ -44,16 +47,32 @@
 #include <freerdp/codec/nsc.h>
 #include <winpr/input.h>
 
+#if FREERDP_VERSION_MAJOR > 1 || FREERDP_VERSION_MINOR >= 2
+#define HAVE_FRAME_ACKNOWLEDGE 1
+#endif
+
 #include "compositor.h"
 #include "pixman-renderer.h"
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE wl_fixed_from_int(10)
-#define RDP_MODE_FREQ 60 * 1000
+#define RDP_TILE_DIFF_SIZE 64
+#define RDP_ENCODE_TILE_SIZE 64
+#define RDP_ENCODE_JOBS_PER_THREAD 2
+
+/* A peer is congested, and its damage held back, when it has at least
+ * min(FrameAcknowledge, RDP_MAX_PENDING_FRAMES) frames unacknowledged
+ * or, if it doesn't acknowledge frames, more than RDP_MAX_SEND_QUEUE
+ * bytes waiting in the socket send queue. */
+#define RDP_MAX_PENDING_FRAMES 2
+#define RDP_MAX_SEND_QUEUE (256 * 1024)
+#define RDP_SEND_QUEUE_POLL_MS 10
+#define RDP_FRAME_HISTORY 16
 
 struct rdp_compositor_config {
 	int width;
 	int height;
+	int refresh_rate;
 	char *bind_address;
 	int port;
 	char *rdp_key;
@@ -61,10 +80,42 @@ struct rdp_compositor_config {
 	char *server_key;
 	int env_socket;
 	int no_clients_resize;
+	int tile_diff;
+	int encoder_threads;
 };
 
 struct rdp_output;
 
+enum rdp_codec {
+	RDP_CODEC_RFX,
+	RDP_CODEC_NSC,
+};
+
+/* One horizontal band of the damage, encoded as a message of its own */
+struct rdp_encode_job {
+	enum rdp_codec codec;
+	pixman_region32_t region;
+	pixman_image_t *image;
+
+	RFX_CONTEXT *rfx_context;
+	RFX_RECT *rfx_rects;
+	NSC_CONTEXT *nsc_context;
+	wStream *stream;
+};
+
+/* Worker threads encoding large damage in bands. The repaint splits the
+ * damage into jobs, then it and the workers pick jobs until all of them
+ * are encoded, and only then is anything sent. */
+struct rdp_encoder {
+	int num_threads;
+	struct weston_worker_pool *pool;
+
+	int num_jobs;
+	struct rdp_encode_job *jobs;
+	int active_jobs;
+	uint32_t serial;	/* bumped whenever the jobs are encoded */
+};
+
 struct rdp_compositor {
 	struct weston_compositor base;
 
@@ -77,6 +128,10 @@ struct rdp_compositor {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+	int32_t refresh;
+	int tile_diff;
+	struct rdp_encoder encoder;
+	struct wl_listener frame_timing_listener;
 };
 
 enum peer_item_flags {
@@ -89,13 +144,28 @@ struct rdp_peers_item {
 	freerdp_peer *peer;
 	struct weston_seat seat;
 
+	/* flow control */
+	UINT32 frame_id;		/* last frame sent */
+	UINT32 acked_frame_id;		/* last frame acknowledged */
+	struct timespec frame_sent[RDP_FRAME_HISTORY];
+	pixman_region32_t pending_damage;	/* held back while congested */
+	struct wl_event_source *queue_timer;	/* polls the send queue */
+
+	/* statistics */
+	struct timespec connect_time;
+	uint32_t frames_sent;
+	uint32_t frames_skipped;
+	uint64_t bytes_sent;
+	uint32_t latency;		/* ms, averaged over acknowledged frames */
+
 	struct wl_list link;
 };
 
 struct rdp_output {
 	struct weston_output base;
-	struct wl_event_source *finish_frame_timer;
+	struct weston_frame_timer frame_timer;
 	pixman_image_t *shadow_surface;
+	struct weston_tile_diff tile_diff;
 
 	struct wl_list peers;
 };
@@ -114,10 +184,32 @@ struct rdp_peer_context {
 };
 typedef struct rdp_peer_context RdpPeerContext;
 
+#define RDP_ENCODE_CACHE_SIZE 4
+
+struct rdp_encoded_frame {
+	enum rdp_codec codec;
+	RdpPeerContext *owner;		/* whose parameters were used */
+	int in_jobs;			/* payload is in the encoder jobs */
+	uint32_t jobs_serial;		/* rdp_encoder::serial it was encoded at */
+};
+
+/* Payloads encoded during one repaint, so that peers which negotiated
+ * the same codec and parameters are sent the bytes encoded for the
+ * first of them instead of encoding the same damage again. A payload
+ * lives in its owner's encode_stream, or in the encoder jobs if it was
+ * encoded in bands, and is only valid until the next peer refresh of
+ * the owner or the next banded encode. Banded encodes for refreshes
+ * that don't use the cache also reuse the jobs, the serial tells. */
+struct rdp_encode_cache {
+	int count;
+	struct rdp_encoded_frame frames[RDP_ENCODE_CACHE_SIZE];
+};
+
 static void
 rdp_compositor_config_init(struct rdp_compositor_config *config) {
 	config->width = 640;
 	config->height = 480;
+	config->refresh_rate = 60;
 	config->bind_address = NULL;
 	config->port = 3389;
 	config->rdp_key = NULL;
@@ -125,10 +217,335 @@ rdp_compositor_config_init(struct rdp_compositor_config *config) {
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->tile_diff = 0;
+	config->encoder_threads = 0;
+}
+
+static int
+rdp_encode_params_match(RdpPeerContext *a, RdpPeerContext *b, enum rdp_codec codec)
+{
+	switch (codec) {
+	case RDP_CODEC_RFX:
+		/* A context that hasn't sent its headers yet needs them in
+		 * the payload, one that has must not get them again. */
+		return a->rfx_context->header_processed &&
+			b->rfx_context->header_processed &&
+			a->rfx_context->width == b->rfx_context->width &&
+			a->rfx_context->height == b->rfx_context->height &&
+			a->rfx_context->mode == b->rfx_context->mode &&
+			a->rfx_context->pixel_format == b->rfx_context->pixel_format;
+	case RDP_CODEC_NSC:
+		/* all NSC contexts are set up the same way */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static struct rdp_encoded_frame *
+rdp_encode_cache_lookup(struct rdp_encode_cache *cache, RdpPeerContext *context,
+		enum rdp_codec codec)
+{
+	int i;
+
+	if (!cache)
+		return NULL;
+
+	for (i = 0; i < cache->count; i++) {
+		if (cache->frames[i].in_jobs &&
+				cache->frames[i].jobs_serial != context->rdpCompositor->encoder.serial)
+			continue;
+		if (cache->frames[i].codec == codec &&
+				rdp_encode_params_match(cache->frames[i].owner, context, codec))
+			return &cache->frames[i];
+	}
+
+	return NULL;
+}
+
+static void
+rdp_encode_cache_add(struct rdp_encode_cache *cache, RdpPeerContext *context,
+		enum rdp_codec codec, int in_jobs)
+{
+	int i;
+
+	if (!cache)
+		return;
+
+	/* the jobs only hold one payload at a time */
+	if (in_jobs) {
+		for (i = 0; i < cache->count; i++) {
+			if (cache->frames[i].in_jobs)
+				cache->frames[i] = cache->frames[--cache->count];
+		}
+	}
+
+	if (cache->count == RDP_ENCODE_CACHE_SIZE)
+		return;
+
+	cache->frames[cache->count].codec = codec;
+	cache->frames[cache->count].owner = context;
+	cache->frames[cache->count].in_jobs = in_jobs;
+	cache->frames[cache->count].jobs_serial = context->rdpCompositor->encoder.serial;
+	cache->count++;
+}
+
+static void
+rdp_encode_job_run(struct rdp_encode_job *job)
+{
+	pixman_box32_t *extents, *rects;
+	int width, height, stride, nrects, i;
+	RFX_RECT *rfxRect;
+	uint32_t *ptr;
+
+	Stream_Clear(job->stream);
+	Stream_SetPosition(job->stream, 0);
+
+	extents = pixman_region32_extents(&job->region);
+	width = extents->x2 - extents->x1;
+	height = extents->y2 - extents->y1;
+	stride = pixman_image_get_stride(job->image);
+	ptr = pixman_image_get_data(job->image) + extents->x1 +
+				extents->y1 * (stride / sizeof(uint32_t));
+
+	if (job->codec == RDP_CODEC_NSC) {
+		nsc_compose_message(job->nsc_context, job->stream, (BYTE *)ptr,
+				width, height, stride);
+		return;
+	}
+
+	rects = pixman_region32_rectangles(&job->region, &nrects);
+	job->rfx_rects = realloc(job->rfx_rects, nrects * sizeof *rfxRect);
+
+	for (i = 0; i < nrects; i++) {
+		rfxRect = &job->rfx_rects[i];
+		rfxRect->x = rects[i].x1 - extents->x1;
+		rfxRect->y = rects[i].y1 - extents->y1;
+		rfxRect->width = rects[i].x2 - rects[i].x1;
+		rfxRect->height = rects[i].y2 - rects[i].y1;
+	}
+
+	rfx_compose_message(job->rfx_context, job->stream, job->rfx_rects, nrects,
+			(BYTE *)ptr, width, height, stride);
+}
+
+static void
+rdp_encode_job_item(void *data, int job)
+{
+	struct rdp_encoder *encoder = data;
+
+	rdp_encode_job_run(&encoder->jobs[job]);
+}
+
+/* FreeRDP 1.1 has no call sizing a RemoteFX context, rfx_context_reset()
+ * only makes it send the headers again. */
+static void
+rdp_rfx_context_set_size(RFX_CONTEXT *rfx_context, int width, int height)
+{
+	rfx_context->width = width;
+	rfx_context->height = height;
+}
+
+static int
+rdp_encode_job_init(struct rdp_encode_job *job)
+{
+	pixman_region32_init(&job->region);
+
+#if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
+	job->rfx_context = rfx_context_new();
+#else
+	job->rfx_context = rfx_context_new(TRUE);
+#endif
+	job->nsc_context = nsc_context_new();
+	job->stream = Stream_New(NULL, 65536);
+	if (!job->rfx_context || !job->nsc_context || !job->stream)
+		return -1;
+
+	job->rfx_context->mode = RLGR3;
+	rfx_context_set_pixel_format(job->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
+	/* Peers get the headers from their own context, see
+	 * rdp_peer_refresh_rfx(). */
+	job->rfx_context->header_processed = TRUE;
+	nsc_context_set_pixel_format(job->nsc_context, RDP_PIXEL_FORMAT_B8G8R8A8);
+
+	return 0;
+}
+
+static void
+rdp_encode_job_release(struct rdp_encode_job *job)
+{
+	pixman_region32_fini(&job->region);
+	if (job->stream)
+		Stream_Free(job->stream, TRUE);
+	if (job->nsc_context)
+		nsc_context_free(job->nsc_context);
+	if (job->rfx_context)
+		rfx_context_free(job->rfx_context);
+	free(job->rfx_rects);
+}
+
+static void
+rdp_encoder_free_jobs(struct rdp_encoder *encoder)
+{
+	int i;
+
+	for (i = 0; i < encoder->num_jobs; i++)
+		rdp_encode_job_release(&encoder->jobs[i]);
+	free(encoder->jobs);
+	encoder->jobs = NULL;
+	encoder->num_jobs = 0;
+}
+
+static int
+rdp_encoder_init(struct rdp_encoder *encoder, int num_threads)
+{
+	int i;
+
+	encoder->num_jobs = (num_threads + 1) * RDP_ENCODE_JOBS_PER_THREAD;
+	encoder->jobs = zalloc(encoder->num_jobs * sizeof *encoder->jobs);
+	if (!encoder->jobs)
+		return -1;
+
+	for (i = 0; i < encoder->num_jobs; i++) {
+		if (rdp_encode_job_init(&encoder->jobs[i]) < 0) {
+			rdp_encoder_free_jobs(encoder);
+			return -1;
+		}
+	}
+
+	encoder->pool = weston_worker_pool_create(num_threads);
+	if (!encoder->pool) {
+		rdp_encoder_free_jobs(encoder);
+		return -1;
+	}
+
+	encoder->num_threads = weston_worker_pool_get_num_threads(encoder->pool);
+
+	return 0;
+}
+
+static void
+rdp_encoder_release(struct rdp_encoder *encoder)
+{
+	if (encoder->num_threads == 0)
+		return;
+
+	weston_worker_pool_destroy(encoder->pool);
+	encoder->pool = NULL;
+	rdp_encoder_free_jobs(encoder);
+	encoder->num_threads = 0;
+}
+
+/* Splits damage into bands of whole 64x64 RemoteFX tiles, one per job,
+ * and encodes them on the workers. Returns the number of jobs used, 0
+ * if the damage is too small to be worth splitting. */
+static int
+rdp_encoder_encode(struct rdp_encoder *encoder, pixman_region32_t *damage,
+		pixman_image_t *image, RdpPeerContext *context, enum rdp_codec codec)
+{
+	pixman_box32_t *extents = pixman_region32_extents(damage);
+	struct rdp_encode_job *job;
+	int rows, bands, band_height, y, i;
+
+	if (encoder->num_threads == 0)
+		return 0;
+
+	rows = (extents->y2 - extents->y1 + RDP_ENCODE_TILE_SIZE - 1) /
+		RDP_ENCODE_TILE_SIZE;
+	bands = MIN(rows, encoder->num_jobs);
+	if (bands < 2)
+		return 0;
+	band_height = (rows + bands - 1) / bands * RDP_ENCODE_TILE_SIZE;
+
+	encoder->serial++;
+	for (i = 0, y = extents->y1; y < extents->y2; y += band_height) {
+		job = &encoder->jobs[i];
+		pixman_region32_fini(&job->region);
+		pixman_region32_init_rect(&job->region, extents->x1, y,
+				extents->x2 - extents->x1,
+				MIN(band_height, extents->y2 - y));
+		pixman_region32_intersect(&job->region, &job->region, damage);
+		if (!pixman_region32_not_empty(&job->region))
+			continue;
+
+		job->codec = codec;
+		job->image = image;
+		if (codec == RDP_CODEC_RFX) {
+			if (job->rfx_context->width != context->rfx_context->width ||
+			    job->rfx_context->height != context->rfx_context->height)
+				rdp_rfx_context_set_size(job->rfx_context,
+						context->rfx_context->width,
+						context->rfx_context->height);
+			/* the bands continue the peer's frame numbering */
+			job->rfx_context->frame_idx =
+				context->rfx_context->frame_idx + i;
+		}
+		i++;
+	}
+
+	encoder->active_jobs = i;
+	weston_worker_pool_run(encoder->pool, encoder->active_jobs,
+			       rdp_encode_job_item, encoder);
+
+	return encoder->active_jobs;
+}
+
+static void
+rdp_peer_send_surface_bits(freerdp_peer *peer, SURFACE_BITS_COMMAND *cmd)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+
+	context->item.bytes_sent += cmd->bitmapDataLength;
+	peer->update->SurfaceBits(peer->context, cmd);
 }
 
+/* Sends the bands encoded by the jobs. */
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_send_jobs(freerdp_peer *peer, struct rdp_encoder *encoder, UINT16 codecID)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+	struct rdp_encode_job *job;
+	pixman_box32_t *extents;
+	int i;
+
+	for (i = 0; i < encoder->active_jobs; i++) {
+		job = &encoder->jobs[i];
+		extents = pixman_region32_extents(&job->region);
+
+		cmd->destLeft = extents->x1;
+		cmd->destTop = extents->y1;
+		cmd->destRight = extents->x2;
+		cmd->destBottom = extents->y2;
+		cmd->bpp = 32;
+		cmd->codecID = codecID;
+		cmd->width = extents->x2 - extents->x1;
+		cmd->height = extents->y2 - extents->y1;
+		cmd->bitmapDataLength = Stream_GetPosition(job->stream);
+		cmd->bitmapData = Stream_Buffer(job->stream);
+
+		rdp_peer_send_surface_bits(peer, cmd);
+	}
+}
+
+/* Every RemoteFX message a peer is sent counts as one of its frames,
+ * whichever context encoded it. A peer sent a payload encoded for
+ * another, owner, also skips past the owner's frame indices carried in
+ * it, so the messages its own context encodes next never repeat or go
+ * back on an index the peer already received. */
+static void
+rdp_peer_rfx_frames_sent(RdpPeerContext *context, RdpPeerContext *owner,
+		int count)
+{
+	context->rfx_context->frame_idx += count;
+	if (owner != context &&
+	    owner->rfx_context->frame_idx > context->rfx_context->frame_idx)
+		context->rfx_context->frame_idx = owner->rfx_context->frame_idx;
+}
+
+static void
+rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer,
+		struct rdp_encode_cache *cache)
 {
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
@@ -137,9 +554,28 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_encoder *encoder = &context->rdpCompositor->encoder;
+	struct rdp_encoded_frame *frame;
+	int cacheable;
+
+	frame = rdp_encode_cache_lookup(cache, context, RDP_CODEC_RFX);
+	if (frame && frame->in_jobs) {
+		rdp_peer_send_jobs(peer, encoder, peer->settings->RemoteFxCodecId);
+		rdp_peer_rfx_frames_sent(context, frame->owner, encoder->active_jobs);
+		return;
+	}
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	/* The first message of a context carries its headers, it has to
+	 * be encoded in one go. */
+	cacheable = context->rfx_context->header_processed;
+
+	if (!frame && cacheable &&
+			rdp_encoder_encode(encoder, damage, image, context, RDP_CODEC_RFX) > 0) {
+		rdp_encode_cache_add(cache, context, RDP_CODEC_RFX, 1);
+		rdp_peer_send_jobs(peer, encoder, peer->settings->RemoteFxCodecId);
+		rdp_peer_rfx_frames_sent(context, context, encoder->active_jobs);
+		return;
+	}
 
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
@@ -153,6 +589,17 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	cmd->width = width;
 	cmd->height = height;
 
+	if (frame) {
+		cmd->bitmapDataLength = Stream_GetPosition(frame->owner->encode_stream);
+		cmd->bitmapData = Stream_Buffer(frame->owner->encode_stream);
+		rdp_peer_send_surface_bits(peer, cmd);
+		rdp_peer_rfx_frames_sent(context, frame->owner, 1);
+		return;
+	}
+
+	Stream_Clear(context->encode_stream);
+	Stream_SetPosition(context->encode_stream, 0);
+
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
@@ -173,25 +620,39 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
+	if (cacheable)
+		rdp_encode_cache_add(cache, context, RDP_CODEC_RFX, 0);
 
 	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
 	cmd->bitmapData = Stream_Buffer(context->encode_stream);
 
-	update->SurfaceBits(update->context, cmd);
+	rdp_peer_send_surface_bits(peer, cmd);
 }
 
 
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer,
+		struct rdp_encode_cache *cache)
 {
 	int width, height;
 	uint32_t *ptr;
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_encoder *encoder = &context->rdpCompositor->encoder;
+	struct rdp_encoded_frame *frame;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	frame = rdp_encode_cache_lookup(cache, context, RDP_CODEC_NSC);
+	if (frame && frame->in_jobs) {
+		rdp_peer_send_jobs(peer, encoder, peer->settings->NSCodecId);
+		return;
+	}
+
+	if (!frame && rdp_encoder_encode(encoder, damage, image, context, RDP_CODEC_NSC) > 0) {
+		rdp_encode_cache_add(cache, context, RDP_CODEC_NSC, 1);
+		rdp_peer_send_jobs(peer, encoder, peer->settings->NSCodecId);
+		return;
+	}
 
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
@@ -205,15 +666,27 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	cmd->width = width;
 	cmd->height = height;
 
+	if (frame) {
+		cmd->bitmapDataLength = Stream_GetPosition(frame->owner->encode_stream);
+		cmd->bitmapData = Stream_Buffer(frame->owner->encode_stream);
+		rdp_peer_send_surface_bits(peer, cmd);
+		return;
+	}
+
+	Stream_Clear(context->encode_stream);
+	Stream_SetPosition(context->encode_stream, 0);
+
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
 	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
 			cmd->width,	cmd->height,
 			pixman_image_get_stride(image));
+	rdp_encode_cache_add(cache, context, RDP_CODEC_NSC, 0);
+
 	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
 	cmd->bitmapData = Stream_Buffer(context->encode_stream);
-	update->SurfaceBits(update->context, cmd);
+	rdp_peer_send_surface_bits(peer, cmd);
 }
 
 static void
@@ -234,7 +707,6 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 {
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
 	pixman_box32_t *rect, subrect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
@@ -243,10 +715,6 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	if (!nrects)
 		return;
 
-	marker->frameId++;
-	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, marker);
-
 	cmd->bpp = 32;
 	cmd->codecID = 0;
 
@@ -275,41 +743,104 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 			   pixman_image_flipped_subrect(&subrect, image, cmd->bitmapData);
 
 			   /*weston_log("*  sending (%d,%d, %d,%d)\n", subrect.x1, subrect.y1, subrect.x2, subrect.y2); */
-			   update->SurfaceBits(peer->context, cmd);
+			   rdp_peer_send_surface_bits(peer, cmd);
 
 			   remainingHeight -= cmd->height;
 			   top += cmd->height;
 		}
 	}
-
-	marker->frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, marker);
 }
 
 static void
-rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer,
+		struct rdp_encode_cache *cache)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpCompositor->output;
 	rdpSettings *settings = peer->settings;
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+
+	/* only peers that negotiated frame markers get them, and only
+	 * those can acknowledge frames */
+	if (settings->SurfaceFrameMarkerEnabled) {
+		marker->frameId++;
+		marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+		update->SurfaceFrameMarker(peer->context, marker);
+
+		context->item.frame_id = marker->frameId;
+		clock_gettime(CLOCK_MONOTONIC,
+			      &context->item.frame_sent[marker->frameId % RDP_FRAME_HISTORY]);
+	}
 
 	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
+		rdp_peer_refresh_rfx(region, output->shadow_surface, peer, cache);
 	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
+		rdp_peer_refresh_nsc(region, output->shadow_surface, peer, cache);
 	else
 		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+
+	if (settings->SurfaceFrameMarkerEnabled) {
+		marker->frameAction = SURFACECMD_FRAMEACTION_END;
+		update->SurfaceFrameMarker(peer->context, marker);
+	}
+	context->item.frames_sent++;
+}
+
+static int
+rdp_peer_uses_frame_ack(struct rdp_peers_item *item)
+{
+#ifdef HAVE_FRAME_ACKNOWLEDGE
+	return item->peer->settings->SurfaceFrameMarkerEnabled &&
+		item->peer->settings->FrameAcknowledge > 0;
+#else
+	return 0;
+#endif
+}
+
+static int
+rdp_peer_congested(struct rdp_peers_item *item)
+{
+	int queued;
+
+#ifdef HAVE_FRAME_ACKNOWLEDGE
+	/* FrameAcknowledge is the most frames the peer lets us have in
+	 * flight, reaching it means we must wait */
+	if (rdp_peer_uses_frame_ack(item))
+		return item->frame_id - item->acked_frame_id >=
+			MIN(item->peer->settings->FrameAcknowledge,
+			    RDP_MAX_PENDING_FRAMES);
+#endif
+
+	if (ioctl(item->peer->sockfd, SIOCOUTQ, &queued) < 0)
+		return 0;
+
+	return queued > RDP_MAX_SEND_QUEUE;
+}
+
+/* Peers not acknowledging frames have their send queue checked on a
+ * timer while congested, the repaint only happens once it drained. */
+static int
+rdp_peer_queue_timer(void *data)
+{
+	RdpPeerContext *context = data;
+	struct rdp_peers_item *item = &context->item;
+
+	if (rdp_peer_congested(item))
+		wl_event_source_timer_update(item->queue_timer,
+					     RDP_SEND_QUEUE_POLL_MS);
+	else
+		weston_output_schedule_repaint(&context->rdpCompositor->output->base);
+
+	return 1;
 }
 
 static void
-rdp_output_start_repaint_loop(struct weston_output *output)
+rdp_output_start_repaint_loop(struct weston_output *output_base)
 {
-	uint32_t msec;
-	struct timeval tv;
+	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 
-	gettimeofday(&tv, NULL);
-	msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-	weston_output_finish_frame(output, msec);
+	weston_frame_timer_finish_frame(&output->frame_timer);
 }
 
 static int
@@ -317,25 +848,59 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct rdp_compositor *c = (struct rdp_compositor *)ec;
 	struct rdp_peers_item *outputPeer;
+	struct rdp_encode_cache cache;
+	pixman_region32_t encode_damage;
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
-	if (pixman_region32_not_empty(damage)) {
-		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
+	pixman_region32_init(&encode_damage);
+	pixman_region32_copy(&encode_damage, damage);
+	if (c->tile_diff && pixman_region32_not_empty(&encode_damage))
+		weston_tile_diff_filter(&output->tile_diff, output->shadow_surface,
+				&encode_damage);
+
+	/* Congested peers are skipped and their damage held back until
+	 * they have caught up. The peers that get this frame's damage as is
+	 * can share encoded payloads. */
+	cache.count = 0;
+	wl_list_for_each(outputPeer, &output->peers, link) {
+		if (!(outputPeer->flags & RDP_PEER_ACTIVATED) ||
+				!(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
+			continue;
+
+		pixman_region32_union(&outputPeer->pending_damage,
+				&outputPeer->pending_damage, &encode_damage);
+		pixman_region32_intersect(&outputPeer->pending_damage,
+				&outputPeer->pending_damage, &output->base.region);
+		if (!pixman_region32_not_empty(&outputPeer->pending_damage))
+			continue;
+
+		if (rdp_peer_congested(outputPeer)) {
+			if (pixman_region32_not_empty(&encode_damage))
+				outputPeer->frames_skipped++;
+			/* peers acknowledging frames get a repaint scheduled
+			 * when they do, the others are polled */
+			if (!rdp_peer_uses_frame_ack(outputPeer))
+				wl_event_source_timer_update(outputPeer->queue_timer,
+							     RDP_SEND_QUEUE_POLL_MS);
+			continue;
 		}
+
+		if (pixman_region32_equal(&outputPeer->pending_damage, &encode_damage))
+			rdp_peer_refresh_region(&encode_damage, outputPeer->peer, &cache);
+		else
+			rdp_peer_refresh_region(&outputPeer->pending_damage, outputPeer->peer, NULL);
+		pixman_region32_clear(&outputPeer->pending_damage);
 	}
+	pixman_region32_fini(&encode_damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	weston_frame_timer_schedule(&output->frame_timer);
 	return 0;
 }
 
@@ -344,18 +909,11 @@ rdp_output_destroy(struct weston_output *output_base)
 {
 	struct rdp_output *output = (struct rdp_output *)output_base;
 
-	wl_event_source_remove(output->finish_frame_timer);
+	weston_frame_timer_release(&output->frame_timer);
+	weston_tile_diff_release(&output->tile_diff);
 	free(output);
 }
 
-static int
-finish_frame_handler(void *data)
-{
-	rdp_output_start_repaint_loop(data);
-
-	return 1;
-}
-
 static struct weston_mode *
 rdp_insert_new_mode(struct weston_output *output, int width, int height, int rate) {
 	struct weston_mode *ret;
@@ -378,7 +936,7 @@ ensure_matching_mode(struct weston_output *output, struct weston_mode *target) {
 			return local;
 	}
 
-	return rdp_insert_new_mode(output, target->width, target->height, RDP_MODE_FREQ);
+	return rdp_insert_new_mode(output, target->width, target->height, target->refresh);
 }
 
 static int
@@ -404,7 +962,7 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode) {
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
 	pixman_renderer_output_destroy(output);
-	pixman_renderer_output_create(output);
+	pixman_renderer_output_create(output, PIXMAN_RENDERER_OUTPUT_DIRECT);
 
 	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
 			target_mode->height, 0, target_mode->width * 4);
@@ -435,7 +993,6 @@ static int
 rdp_compositor_create_output(struct rdp_compositor *c, int width, int height)
 {
 	struct rdp_output *output;
-	struct wl_event_loop *loop;
 	struct weston_mode *currentMode;
 	struct weston_mode initMode;
 
@@ -445,11 +1002,12 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height)
 
 	wl_list_init(&output->peers);
 	wl_list_init(&output->base.mode_list);
+	weston_tile_diff_init(&output->tile_diff, RDP_TILE_DIFF_SIZE);
 
 	initMode.flags = WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	initMode.width = width;
 	initMode.height = height;
-	initMode.refresh = RDP_MODE_FREQ;
+	initMode.refresh = c->refresh;
 
 	currentMode = ensure_matching_mode(&output->base, &initMode);
 	if (!currentMode)
@@ -470,11 +1028,13 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height)
 		goto out_output;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base,
+					  PIXMAN_RENDERER_OUTPUT_DIRECT) < 0)
 		goto out_shadow_surface;
 
-	loop = wl_display_get_event_loop(c->base.wl_display);
-	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
+	if (weston_frame_timer_init(&output->frame_timer, &output->base,
+				    c->refresh) < 0)
+		goto out_renderer;
 
 	output->base.start_repaint_loop = rdp_output_start_repaint_loop;
 	output->base.repaint = rdp_output_repaint;
@@ -488,6 +1048,8 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height)
 	wl_list_insert(c->base.output_list.prev, &output->base.link);
 	return 0;
 
+out_renderer:
+	pixman_renderer_output_destroy(&output->base);
 out_shadow_surface:
 	pixman_image_unref(output->shadow_surface);
 out_output:
@@ -505,6 +1067,9 @@ rdp_restore(struct weston_compositor *ec)
 static void
 rdp_destroy(struct weston_compositor *ec)
 {
+	struct rdp_compositor *c = (struct rdp_compositor *)ec;
+
+	rdp_encoder_release(&c->encoder);
 	weston_compositor_shutdown(ec);
 
 	free(ec);
@@ -554,6 +1119,7 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 {
 	context->item.peer = client;
 	context->item.flags = RDP_PEER_OUTPUT_ENABLED;
+	pixman_region32_init(&context->item.pending_damage);
 
 #if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
 	context->rfx_context = rfx_context_new();
@@ -561,8 +1127,9 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	context->rfx_context = rfx_context_new(TRUE);
 #endif
 	context->rfx_context->mode = RLGR3;
-	context->rfx_context->width = client->settings->DesktopWidth;
-	context->rfx_context->height = client->settings->DesktopHeight;
+	rdp_rfx_context_set_size(context->rfx_context,
+			client->settings->DesktopWidth,
+			client->settings->DesktopHeight);
 	rfx_context_set_pixel_format(context->rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
 
 	context->nsc_context = nsc_context_new();
@@ -571,6 +1138,44 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	context->encode_stream = Stream_New(NULL, 65536);
 }
 
+static uint32_t
+timespec_to_msec(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+static void
+rdp_peer_log_stats(struct rdp_peers_item *item)
+{
+	struct timespec now;
+	uint32_t elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = timespec_to_msec(&now) - timespec_to_msec(&item->connect_time);
+
+	weston_log("RDP peer %s: %u frames sent, %u skipped, %llu KiB "
+		   "(%llu KiB/s), latency %u ms\n",
+		   item->peer->hostname, item->frames_sent,
+		   item->frames_skipped,
+		   (unsigned long long) item->bytes_sent / 1024,
+		   elapsed ? (unsigned long long) item->bytes_sent / elapsed *
+			     1000 / 1024 : 0,
+		   item->latency);
+}
+
+static void
+rdp_frame_timing_notify(struct wl_listener *listener, void *data)
+{
+	struct rdp_compositor *c = container_of(listener, struct rdp_compositor,
+						frame_timing_listener);
+	struct rdp_peers_item *item;
+
+	wl_list_for_each(item, &c->output->peers, link) {
+		if (item->flags & RDP_PEER_ACTIVATED)
+			rdp_peer_log_stats(item);
+	}
+}
+
 static void
 rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 {
@@ -583,8 +1188,11 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		if (context->events[i])
 			wl_event_source_remove(context->events[i]);
 	}
+	if (context->item.queue_timer)
+		wl_event_source_remove(context->item.queue_timer);
 
 	if (context->item.flags & RDP_PEER_ACTIVATED) {
+		rdp_peer_log_stats(&context->item);
 		weston_seat_release_keyboard(&context->item.seat);
 		weston_seat_release_pointer(&context->item.seat);
 		weston_seat_release(&context->item.seat);
@@ -593,6 +1201,7 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
 	free(context->rfx_rects);
+	pixman_region32_fini(&context->item.pending_damage);
 }
 
 
@@ -693,6 +1302,7 @@ xf_peer_post_connect(freerdp_peer* client)
 			struct weston_mode *target_mode;
 			new_mode.width = (int)settings->DesktopWidth;
 			new_mode.height = (int)settings->DesktopHeight;
+			new_mode.refresh = output->base.current_mode->refresh;
 			target_mode = ensure_matching_mode(&output->base, &new_mode);
 			if (!target_mode) {
 				weston_log("client mode not found\n");
@@ -732,6 +1342,7 @@ xf_peer_post_connect(freerdp_peer* client)
 	weston_seat_init_pointer(&peerCtx->item.seat);
 
 	peerCtx->item.flags |= RDP_PEER_ACTIVATED;
+	clock_gettime(CLOCK_MONOTONIC, &peerCtx->item.connect_time);
 
 	/* disable pointer on the client side */
 	pointer = client->update->pointer;
@@ -745,7 +1356,7 @@ xf_peer_post_connect(freerdp_peer* client)
 	box.y2 = output->base.height;
 	pixman_region32_init_with_extents(&damage, &box);
 
-	rdp_peer_refresh_region(&damage, client);
+	rdp_peer_refresh_region(&damage, client, NULL);
 
 	pixman_region32_fini(&damage);
 
@@ -839,7 +1450,7 @@ xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 	box.y2 = output->base.height;
 	pixman_region32_init_with_extents(&damage, &box);
 
-	rdp_peer_refresh_region(&damage, client);
+	rdp_peer_refresh_region(&damage, client, NULL);
 
 	pixman_region32_fini(&damage);
 }
@@ -908,6 +1519,34 @@ xf_suppress_output(rdpContext *context, BYTE allow, RECTANGLE_16 *area) {
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
 }
 
+#ifdef HAVE_FRAME_ACKNOWLEDGE
+static BOOL
+xf_surface_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	struct rdp_peers_item *item = &peerContext->item;
+	struct rdp_output *output = peerContext->rdpCompositor->output;
+	struct timespec now;
+	uint32_t latency;
+
+	/* acknowledgements for frames older than the history are too late
+	 * to be worth averaging in */
+	if (item->frame_id - frameId < RDP_FRAME_HISTORY) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		latency = timespec_to_msec(&now) -
+			timespec_to_msec(&item->frame_sent[frameId % RDP_FRAME_HISTORY]);
+		item->latency = item->latency ?
+			(item->latency * 7 + latency) / 8 : latency;
+	}
+
+	item->acked_frame_id = frameId;
+	if (pixman_region32_not_empty(&item->pending_damage))
+		weston_output_schedule_repaint(&output->base);
+
+	return TRUE;
+}
+#endif
+
 static int
 rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 {
@@ -944,6 +1583,9 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = xf_suppress_output;
+#ifdef HAVE_FRAME_ACKNOWLEDGE
+	client->update->SurfaceFrameAcknowledge = xf_surface_frame_acknowledge;
+#endif
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -974,6 +1616,9 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 	for ( ; i < MAX_FREERDP_FDS; i++)
 		peerCtx->events[i] = 0;
 
+	peerCtx->item.queue_timer = wl_event_loop_add_timer(loop,
+			rdp_peer_queue_timer, peerCtx);
+
 	wl_list_insert(&c->output->peers, &peerCtx->item.link);
 	return 0;
 }
@@ -1007,6 +1652,8 @@ rdp_compositor_create(struct wl_display *display,
 	c->base.restore = rdp_restore;
 	c->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	c->no_clients_resize = config->no_clients_resize;
+	c->refresh = config->refresh_rate * 1000;
+	c->tile_diff = config->tile_diff;
 
 	/* activate TLS only if certificate/key are available */
 	if (config->server_cert && config->server_key) {
@@ -1026,6 +1673,18 @@ rdp_compositor_create(struct wl_display *display,
 
 	c->base.capabilities |= WESTON_CAP_ARBITRARY_MODES;
 
+	c->frame_timing_listener.notify = rdp_frame_timing_notify;
+	wl_signal_add(&c->base.frame_timing_signal, &c->frame_timing_listener);
+
+	if (config->encoder_threads > 0) {
+		if (rdp_encoder_init(&c->encoder, config->encoder_threads) < 0)
+			weston_log("failed to start encoder threads, "
+				   "encoding serially\n");
+		else
+			weston_log("encoding on %d worker threads\n",
+				   c->encoder.num_threads);
+	}
+
 	if(!config->env_socket) {
 		c->listener = freerdp_listener_new();
 		c->listener->PeerAccepted = rdp_incoming_peer;
@@ -1057,6 +1716,7 @@ err_listener:
 err_output:
 	weston_output_destroy(&c->output->base);
 err_compositor:
+	rdp_encoder_release(&c->encoder);
 	weston_compositor_shutdown(&c->base);
 err_free_strings:
 	if (c->rdp_key)
@@ -1076,6 +1736,7 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 {
 	struct rdp_compositor_config config;
 	rdp_compositor_config_init(&config);
+	struct weston_config_section *section;
 	int major, minor, revision;
 
 	freerdp_get_version(&major, &minor, &revision);
@@ -1086,14 +1747,30 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 		{ WESTON_OPTION_BOOLEAN, "env-socket", 0, &config.env_socket },
 		{ WESTON_OPTION_INTEGER, "width", 0, &config.width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &config.height },
+		{ WESTON_OPTION_INTEGER, "refresh-rate", 0, &config.refresh_rate },
 		{ WESTON_OPTION_STRING,  "address", 0, &config.bind_address },
 		{ WESTON_OPTION_INTEGER, "port", 0, &config.port },
 		{ WESTON_OPTION_BOOLEAN, "no-clients-resize", 0, &config.no_clients_resize },
+		{ WESTON_OPTION_BOOLEAN, "tile-diff", 0, &config.tile_diff },
+		{ WESTON_OPTION_INTEGER, "encoder-threads", 0, &config.encoder_threads },
 		{ WESTON_OPTION_STRING,  "rdp4-key", 0, &config.rdp_key },
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
 		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key }
 	};
 
+	section = weston_config_get_section(wconfig, "core", NULL, NULL);
+	weston_config_section_get_int(section, "refresh-rate",
+				      &config.refresh_rate,
+				      config.refresh_rate);
+	weston_config_section_get_bool(section, "tile-diff",
+				       &config.tile_diff, config.tile_diff);
+	weston_config_section_get_int(section, "rdp-encoder-threads",
+				      &config.encoder_threads,
+				      config.encoder_threads);
+
 	parse_options(rdp_options, ARRAY_LENGTH(rdp_options), argc, argv);
+	if (config.refresh_rate < 0)
+		config.refresh_rate = 60;
+
 	return rdp_compositor_create(display, &config, argc, argv, wconfig);
 }
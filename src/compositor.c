@@ -38,6 +38,7 @@
 #include <sys/socket.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <math.h>
 #include <linux/input.h>
@@ -95,6 +96,12 @@ weston_output_transform_scale_init(struct weston_output *output,
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor);
 
+static void
+weston_view_pick_index_update(struct weston_view *view);
+
+static void
+weston_view_pick_index_remove(struct weston_view *view);
+
 WL_EXPORT int
 weston_output_switch_mode(struct weston_output *output, struct weston_mode *mode,
 		int32_t scale, enum weston_mode_switch_op op)
@@ -725,6 +732,7 @@ weston_view_move_to_plane(struct weston_view *view,
 
 	weston_view_damage_below(view);
 	view->plane = plane;
+	view->surface->compositor->damage_dirty = 1;
 	weston_surface_damage(view->surface);
 }
 
@@ -888,7 +896,8 @@ view_compute_bbox(struct weston_view *view, int32_t sx, int32_t sy,
 	pixman_region32_init_rect(bbox, int_x, int_y,
 				  ceilf(max_x) - int_x, ceilf(max_y) - int_y);
 
-	WESTON_PLUGIN_CALL(view->surface->compositor, compute_bbox, view, bbox);
+	WESTON_PLUGIN_CALL_VIEW(view->surface->compositor, compute_bbox, view,
+				bbox);
 }
 
 static void
@@ -974,6 +983,7 @@ weston_view_update_transform(struct weston_view *view)
 		weston_view_update_transform(parent);
 
 	view->transform.dirty = 0;
+	view->surface->compositor->damage_dirty = 1;
 
 	weston_view_damage_below(view);
 
@@ -997,6 +1007,8 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_assign_output(view);
 
+	weston_view_pick_index_update(view);
+
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
@@ -1116,6 +1128,7 @@ weston_surface_damage(struct weston_surface *surface)
 	pixman_region32_union_rect(&surface->damage, &surface->damage,
 				   0, 0, surface->width,
 				   surface->height);
+	surface->compositor->damage_dirty = 1;
 
 	weston_surface_schedule_repaint(surface);
 }
@@ -1269,19 +1282,211 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/* The pick grid hashes 256x256 cells into a fixed number of buckets.
+ * Cells colliding in a bucket only cost an extra box test per view.
+ */
+#define PICK_GRID_SHIFT		8
+#define PICK_GRID_BUCKETS	1024
+#define PICK_GRID_MAX_CELLS	256
+
+static struct wl_array *
+pick_grid_bucket(struct weston_compositor *compositor, int32_t cx, int32_t cy)
+{
+	uint32_t hash = (uint32_t) cx * 73856093u ^ (uint32_t) cy * 19349663u;
+
+	return &compositor->pick_grid[hash & (PICK_GRID_BUCKETS - 1)];
+}
+
+static void
+pick_bucket_insert(struct wl_array *bucket, struct weston_view *view)
+{
+	struct weston_view **views = bucket->data, **slot;
+	size_t count = bucket->size / sizeof *views;
+	size_t lo = 0, hi = count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (views[mid]->pick.order < view->pick.order)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Several cells of the same view may hash to this bucket. */
+	if (lo < count && views[lo] == view)
+		return;
+
+	slot = wl_array_add(bucket, sizeof *slot);
+	if (!slot) {
+		weston_log("failed to grow pick index\n");
+		return;
+	}
+
+	views = bucket->data;
+	memmove(&views[lo + 1], &views[lo], (count - lo) * sizeof *views);
+	views[lo] = view;
+}
+
+static void
+pick_bucket_remove(struct wl_array *bucket, struct weston_view *view)
+{
+	struct weston_view **views = bucket->data;
+	size_t count = bucket->size / sizeof *views;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (views[i] == view) {
+			memmove(&views[i], &views[i + 1],
+				(count - i - 1) * sizeof *views);
+			bucket->size -= sizeof *views;
+			return;
+		}
+	}
+}
+
+static void
+weston_view_pick_index_apply(struct weston_view *view,
+			     void (*func)(struct wl_array *bucket,
+					  struct weston_view *view))
+{
+	struct weston_compositor *compositor = view->surface->compositor;
+	pixman_box32_t *box = &view->pick.box;
+	int32_t cx, cy;
+
+	if (view->pick.unbounded) {
+		func(&compositor->pick_unbounded, view);
+		return;
+	}
+
+	for (cy = box->y1 >> PICK_GRID_SHIFT;
+	     cy <= (box->y2 - 1) >> PICK_GRID_SHIFT; cy++)
+		for (cx = box->x1 >> PICK_GRID_SHIFT;
+		     cx <= (box->x2 - 1) >> PICK_GRID_SHIFT; cx++)
+			func(pick_grid_bucket(compositor, cx, cy), view);
+}
+
+static void
+weston_view_pick_index_add(struct weston_view *view, uint32_t order)
+{
+	struct weston_surface *surface = view->surface;
+	pixman_box32_t *input = pixman_region32_extents(&surface->input);
+	pixman_box32_t *bbox =
+		pixman_region32_extents(&view->transform.boundingbox);
+	int64_t cells;
+
+	view->pick.indexed = 1;
+	view->pick.order = order;
+
+	/* Grow the box by a pixel: picking truncates view-local
+	 * coordinates, which accepts points just outside the view. */
+	view->pick.box.x1 = bbox->x1 - 1;
+	view->pick.box.y1 = bbox->y1 - 1;
+	view->pick.box.x2 = bbox->x2 + 1;
+	view->pick.box.y2 = bbox->y2 + 1;
+
+	cells = (int64_t) (((view->pick.box.x2 - 1) >> PICK_GRID_SHIFT) -
+			   (view->pick.box.x1 >> PICK_GRID_SHIFT) + 1) *
+		(((view->pick.box.y2 - 1) >> PICK_GRID_SHIFT) -
+		 (view->pick.box.y1 >> PICK_GRID_SHIFT) + 1);
+
+	view->pick.unbounded =
+		input->x1 < 0 || input->y1 < 0 ||
+		input->x2 > surface->width || input->y2 > surface->height ||
+		cells > PICK_GRID_MAX_CELLS;
+
+	weston_view_pick_index_apply(view, pick_bucket_insert);
+}
+
+static void
+weston_view_pick_index_remove(struct weston_view *view)
+{
+	if (!view->pick.indexed)
+		return;
+
+	weston_view_pick_index_apply(view, pick_bucket_remove);
+	view->pick.indexed = 0;
+}
+
+static void
+weston_view_pick_index_update(struct weston_view *view)
+{
+	if (!view->pick.indexed)
+		return;
+
+	weston_view_pick_index_remove(view);
+	weston_view_pick_index_add(view, view->pick.order);
+}
+
+static void
+pick_bucket_clear(struct wl_array *bucket)
+{
+	struct weston_view **view;
+
+	wl_array_for_each(view, bucket)
+		(*view)->pick.indexed = 0;
+	bucket->size = 0;
+}
+
+static void
+weston_compositor_rebuild_pick_index(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	uint32_t order = 0;
+	int i;
+
+	for (i = 0; i < PICK_GRID_BUCKETS; i++)
+		pick_bucket_clear(&compositor->pick_grid[i]);
+	pick_bucket_clear(&compositor->pick_unbounded);
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		weston_view_pick_index_add(view, order++);
+}
+
+static int
+weston_view_accepts_input(struct weston_view *view,
+			  wl_fixed_t x, wl_fixed_t y,
+			  wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	weston_view_from_global_fixed(view, x, y, vx, vy);
+
+	return pixman_region32_contains_point(&view->surface->input,
+					      wl_fixed_to_int(*vx),
+					      wl_fixed_to_int(*vy),
+					      NULL);
+}
+
 WL_EXPORT struct weston_view *
 weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
+	int32_t ix = floor(wl_fixed_to_double(x));
+	int32_t iy = floor(wl_fixed_to_double(y));
+	struct wl_array *bucket;
+	struct weston_view **grid, **unbounded, *view;
+	size_t grid_count, unbounded_count, i = 0, j = 0;
+
+	bucket = pick_grid_bucket(compositor, ix >> PICK_GRID_SHIFT,
+				  iy >> PICK_GRID_SHIFT);
+	grid = bucket->data;
+	grid_count = bucket->size / sizeof *grid;
+	unbounded = compositor->pick_unbounded.data;
+	unbounded_count = compositor->pick_unbounded.size / sizeof *unbounded;
+
+	/* Both lists are sorted top to bottom, merge them. */
+	while (i < grid_count || j < unbounded_count) {
+		if (j == unbounded_count ||
+		    (i < grid_count &&
+		     grid[i]->pick.order < unbounded[j]->pick.order)) {
+			view = grid[i++];
+			if (ix < view->pick.box.x1 || ix >= view->pick.box.x2 ||
+			    iy < view->pick.box.y1 || iy >= view->pick.box.y2)
+				continue;
+		} else {
+			view = unbounded[j++];
+		}
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		weston_view_from_global_fixed(view, x, y, vx, vy);
-		if (pixman_region32_contains_point(&view->surface->input,
-						   wl_fixed_to_int(*vx),
-						   wl_fixed_to_int(*vy),
-						   NULL))
+		if (weston_view_accepts_input(view, x, y, vx, vy))
 			return view;
 	}
 
@@ -1309,14 +1514,17 @@ weston_view_unmap(struct weston_view *view)
 		return;
 
 	weston_view_damage_below(view);
+	weston_view_pick_index_remove(view);
 	view->output = NULL;
 	view->plane = NULL;
+	view->surface->compositor->damage_dirty = 1;
 	wl_list_remove(&view->layer_link);
 	wl_list_init(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
+	weston_compositor_view_list_dirty(view->surface->compositor);
 
 	if (weston_surface_is_mapped(view->surface))
 		return;
@@ -1370,9 +1578,16 @@ weston_view_destroy(struct weston_view *view)
 	if (weston_view_is_mapped(view)) {
 		weston_view_unmap(view);
 		weston_compositor_build_view_list(view->surface->compositor);
-		WESTON_PLUGIN_CALL(view->surface->compositor, view_fini, view);
 	}
 
+	/* Plugins may have state in view->plugin_data even for views
+	 * that were unmapped before. */
+	WESTON_PLUGIN_CALL_VIEW(view->surface->compositor, view_fini, view);
+
+	/* The view may still be cached in view_list_order. */
+	weston_compositor_view_list_dirty(view->surface->compositor);
+	weston_view_pick_index_remove(view);
+
 	wl_list_remove(&view->link);
 	wl_list_remove(&view->layer_link);
 
@@ -1560,33 +1775,41 @@ static void
 view_accumulate_damage(struct weston_view *view,
 		       pixman_region32_t *opaque)
 {
+	struct weston_compositor *ec = view->surface->compositor;
 	pixman_region32_t damage;
 
-	pixman_region32_init(&damage);
-	if (view->transform.enabled) {
-		pixman_box32_t *extents;
-
-		extents = pixman_region32_extents(&view->surface->damage);
-		view_compute_bbox(view, extents->x1, extents->y1,
-				  extents->x2 - extents->x1,
-				  extents->y2 - extents->y1,
-				  &damage);
-		pixman_region32_translate(&damage,
-					  -view->plane->x,
-					  -view->plane->y);
-	} else {
-		pixman_region32_copy(&damage, &view->surface->damage);
-		pixman_region32_translate(&damage,
-					  view->geometry.x - view->plane->x,
-					  view->geometry.y - view->plane->y);
+	/* Surface damage is consumed by the first output to repaint after
+	 * a commit, the other outputs only need the clip. */
+	if (pixman_region32_not_empty(&view->surface->damage)) {
+		pixman_region32_init(&damage);
+		if (view->transform.enabled) {
+			pixman_box32_t *extents;
+
+			extents = pixman_region32_extents(&view->surface->damage);
+			view_compute_bbox(view, extents->x1, extents->y1,
+					  extents->x2 - extents->x1,
+					  extents->y2 - extents->y1,
+					  &damage);
+			pixman_region32_translate(&damage,
+						  -view->plane->x,
+						  -view->plane->y);
+		} else {
+			pixman_region32_copy(&damage, &view->surface->damage);
+			pixman_region32_translate(&damage,
+						  view->geometry.x - view->plane->x,
+						  view->geometry.y - view->plane->y);
+		}
+
+		pixman_region32_subtract(&damage, &damage, opaque);
+		pixman_region32_union(&view->plane->damage,
+				      &view->plane->damage, &damage);
+		pixman_region32_fini(&damage);
+		ec->damage_region_ops += 4;
 	}
 
-	pixman_region32_subtract(&damage, &damage, opaque);
-	pixman_region32_union(&view->plane->damage,
-			      &view->plane->damage, &damage);
-	pixman_region32_fini(&damage);
 	pixman_region32_copy(&view->clip, opaque);
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
+	ec->damage_region_ops += 2;
 }
 
 static void
@@ -1594,24 +1817,33 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 {
 	struct weston_plane *plane;
 	struct weston_view *ev;
-	pixman_region32_t opaque, clip;
+	pixman_region32_t clip;
 
-	pixman_region32_init(&clip);
+	/* Every output repaint comes through here, but the result only
+	 * depends on global state. Skip the work if nothing changed since
+	 * another output accumulated. */
+	if (!ec->damage_dirty)
+		return;
+	ec->damage_dirty = 0;
 
-	wl_list_for_each(plane, &ec->plane_list, link) {
-		pixman_region32_copy(&plane->clip, &clip);
+	wl_list_for_each(plane, &ec->plane_list, link)
+		empty_region(&plane->opaque);
 
-		pixman_region32_init(&opaque);
+	/* A single pass over the views, each one accumulating into the
+	 * opaque region of its own plane. */
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!ev->plane)
+			continue;
 
-		wl_list_for_each(ev, &ec->view_list, link) {
-			if (ev->plane != plane)
-				continue;
+		view_accumulate_damage(ev, &ev->plane->opaque);
+	}
 
-			view_accumulate_damage(ev, &opaque);
-		}
+	pixman_region32_init(&clip);
 
-		pixman_region32_union(&clip, &clip, &opaque);
-		pixman_region32_fini(&opaque);
+	wl_list_for_each(plane, &ec->plane_list, link) {
+		pixman_region32_copy(&plane->clip, &clip);
+		pixman_region32_union(&clip, &clip, &plane->opaque);
+		ec->damage_region_ops += 2;
 	}
 
 	pixman_region32_fini(&clip);
@@ -1735,26 +1967,189 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+WL_EXPORT void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_dirty = 1;
+}
+
+/* Shells and plugins restack views by manipulating the layer lists
+ * directly, so compare the layers against the top-level views recorded
+ * by the last rebuild. This is a pointer walk and much cheaper than
+ * relinking every view and its sub-surfaces.
+ */
+static int
+weston_compositor_layers_changed(struct weston_compositor *compositor)
+{
+	struct weston_view **order = compositor->view_list_order.data;
+	size_t count = compositor->view_list_order.size / sizeof *order;
+	struct weston_layer *layer;
+	struct weston_view *view;
+	size_t i = 0;
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		wl_list_for_each(view, &layer->view_list, layer_link) {
+			if (i >= count || order[i] != view)
+				return 1;
+			i++;
+		}
+	}
+
+	return i != count;
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
-	struct weston_view *view;
+	struct weston_view *view, **entry;
 	struct weston_layer *layer;
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list, layer_link)
 			surface_stash_subsurface_views(view->surface);
 
+	compositor->view_list_order.size = 0;
 	wl_list_init(&compositor->view_list);
 	wl_list_for_each(layer, &compositor->layer_list, link) {
 		wl_list_for_each(view, &layer->view_list, layer_link) {
 			view_list_add(compositor, view);
+
+			entry = wl_array_add(&compositor->view_list_order,
+					     sizeof *entry);
+			if (entry)
+				*entry = view;
+			else
+				compositor->view_list_dirty = 1;
 		}
 	}
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list, layer_link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Freeing unused sub-surface views marks the list dirty again,
+	 * but they were never linked into the list we just built. */
+	compositor->view_list_dirty = 0;
+	compositor->view_list_rebuilds++;
+	compositor->damage_dirty = 1;
+
+	weston_compositor_rebuild_pick_index(compositor);
+}
+
+/* Bring the view list up to date for a repaint. Only relink the
+ * scene graph if the stacking changed since the last rebuild,
+ * otherwise just refresh the transforms of views that moved.
+ */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	if (compositor->view_list_dirty ||
+	    weston_compositor_layers_changed(compositor)) {
+		weston_compositor_build_view_list(compositor);
+		return;
+	}
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		weston_view_update_transform(view);
+
+	compositor->view_list_reuses++;
+}
+
+#define PLUGIN_HOOK(f) [WESTON_PLUGIN_HOOK(f)] = #f
+
+static const char * const plugin_hook_names[WESTON_PLUGIN_MAX_HOOKS] = {
+	PLUGIN_HOOK(init),
+	PLUGIN_HOOK(fini),
+	PLUGIN_HOOK(input_action),
+	PLUGIN_HOOK(output_set_transform_coords),
+	PLUGIN_HOOK(output_update_matrix),
+	PLUGIN_HOOK(view_init),
+	PLUGIN_HOOK(view_fini),
+	PLUGIN_HOOK(prepare_paint),
+	PLUGIN_HOOK(add_geometry),
+	PLUGIN_HOOK(paint_view),
+	PLUGIN_HOOK(done_paint),
+	PLUGIN_HOOK(resize_notify),
+	PLUGIN_HOOK(move_notify),
+	PLUGIN_HOOK(grab_notify),
+	PLUGIN_HOOK(ungrab_notify),
+	PLUGIN_HOOK(compute_bbox),
+};
+
+/* weston_plugin_interface holds nothing but hook pointers. */
+static uint32_t
+plugin_hook_mask(struct weston_plugin_interface *interface)
+{
+	void (**hooks)(void) = (void (**)(void)) interface;
+	uint32_t mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof *interface / sizeof hooks[0]; i++)
+		if (hooks[i])
+			mask |= 1u << i;
+
+	return mask;
+}
+
+static uint64_t
+plugin_hook_calls(struct weston_compositor *ec)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < WESTON_PLUGIN_MAX_HOOKS; i++)
+		total += ec->plugin_hook_calls[i];
+
+	return total;
+}
+
+static void
+log_plugin_hook_calls(struct weston_compositor *ec)
+{
+	int i;
+
+	for (i = 0; i < WESTON_PLUGIN_MAX_HOOKS; i++)
+		if (ec->plugin_hook_calls[i])
+			weston_log("plugin hook %s: %llu calls\n",
+				   plugin_hook_names[i],
+				   (unsigned long long) ec->plugin_hook_calls[i]);
+}
+
+static inline void
+frame_timing_stamp(struct weston_output *output, uint64_t *stamp)
+{
+	if (output->timing_ring)
+		*stamp = weston_frame_timing_now();
+}
+
+static void
+frame_timing_count_damage(struct weston_output *output,
+			  struct weston_frame_timing *timing,
+			  pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view *ev;
+	pixman_box32_t *rects;
+	int i, n;
+
+	rects = pixman_region32_rectangles(damage, &n);
+	timing->damage_rects = n;
+	timing->damage_area = 0;
+	for (i = 0; i < n; i++)
+		timing->damage_area += (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	timing->views_drawn = 0;
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (ev->plane != &ec->primary_plane)
+			continue;
+		if (pixman_region32_contains_rectangle(damage,
+			pixman_region32_extents(&ev->transform.boundingbox)) !=
+		    PIXMAN_REGION_OUT)
+			timing->views_drawn++;
+	}
 }
 
 static int
@@ -1765,20 +2160,32 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
+	struct weston_frame_timing timing;
 	pixman_region32_t output_damage;
+	uint32_t region_ops, rebuilds, animation_msecs;
+	uint64_t plugin_calls;
 	int r;
 
 	if (output->destroying)
 		return 0;
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	frame_timing_stamp(output, &timing.begin);
+	timing.msecs = msecs;
+
+	region_ops = ec->damage_region_ops;
+	rebuilds = ec->view_list_rebuilds;
+	plugin_calls = output->timing_ring ? plugin_hook_calls(ec) : 0;
+
+	/* Update the surface list and surface transforms up front. */
+	weston_compositor_update_view_list(ec);
+	frame_timing_stamp(output, &timing.view_list);
 
 	if (output->assign_planes && !output->disable_planes)
 		output->assign_planes(output);
 	else
 		wl_list_for_each(ev, &ec->view_list, link)
 			weston_view_move_to_plane(ev, &ec->primary_plane);
+	frame_timing_stamp(output, &timing.assign_planes);
 
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
@@ -1799,6 +2206,13 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 				  &ec->primary_plane.damage, &output->region);
 	pixman_region32_subtract(&output_damage,
 				 &output_damage, &ec->primary_plane.clip);
+	ec->damage_region_ops += 2;
+	output->repaint_region_ops = ec->damage_region_ops - region_ops;
+	frame_timing_stamp(output, &timing.accumulate_damage);
+
+	/* The backend consumes the damage, count it first. */
+	if (output->timing_ring)
+		frame_timing_count_damage(output, &timing, &output_damage);
 
 	if (output->dirty)
 		weston_output_update_matrix(output);
@@ -1806,6 +2220,7 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 	output->repaint_needed = 0;
 
 	r = output->repaint(output, &output_damage);
+	frame_timing_stamp(output, &timing.repaint);
 
 	pixman_region32_fini(&output_damage);
 
@@ -1817,9 +2232,18 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 		wl_resource_destroy(cb->resource);
 	}
 
+	if (output->timing_ring) {
+		frame_timing_stamp(output, &timing.frame_callbacks);
+		timing.region_ops = output->repaint_region_ops;
+		timing.view_list_rebuilt = ec->view_list_rebuilds != rebuilds;
+		timing.plugin_calls = plugin_hook_calls(ec) - plugin_calls;
+		weston_frame_timing_ring_push(output->timing_ring, &timing);
+	}
+
+	animation_msecs = weston_compositor_get_animation_time(ec);
 	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
 		animation->frame_counter++;
-		animation->frame(animation, output, msecs);
+		animation->frame(animation, output, animation_msecs);
 	}
 
 	return r;
@@ -1863,6 +2287,135 @@ weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
 				     weston_compositor_read_input, compositor);
 }
 
+static int
+frame_timer_handler(void *data)
+{
+	weston_frame_timer_finish_frame(data);
+
+	return 1;
+}
+
+static void
+frame_timer_idle(void *data)
+{
+	struct weston_frame_timer *ft = data;
+
+	ft->idle_source = NULL;
+	weston_frame_timer_finish_frame(ft);
+}
+
+static int
+frame_timer_wakeup(int fd, uint32_t mask, void *data)
+{
+	struct weston_frame_timer *ft = data;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(ft->output->compositor->wl_display);
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 1;
+
+	/* Finishing the frame from an idle handler lets the clients that
+	 * woke up along with us get their requests in first. */
+	if (!ft->idle_source)
+		ft->idle_source =
+			wl_event_loop_add_idle(loop, frame_timer_idle, ft);
+
+	return 1;
+}
+
+WL_EXPORT int
+weston_frame_timer_init(struct weston_frame_timer *ft,
+			struct weston_output *output, int32_t refresh)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(output->compositor->wl_display);
+
+	memset(ft, 0, sizeof *ft);
+	ft->output = output;
+	ft->refresh = refresh;
+	ft->wakeup_fd = -1;
+
+	if (refresh > 0) {
+		ft->timer = wl_event_loop_add_timer(loop, frame_timer_handler,
+						    ft);
+		return ft->timer ? 0 : -1;
+	}
+
+	/* An idle handler added from the repaint, which itself runs
+	 * from an idle handler, would be dispatched right away and starve
+	 * the clients. Go through the event loop once between frames. */
+	ft->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ft->wakeup_fd < 0)
+		return -1;
+
+	ft->wakeup_source = wl_event_loop_add_fd(loop, ft->wakeup_fd,
+						 WL_EVENT_READABLE,
+						 frame_timer_wakeup, ft);
+	if (!ft->wakeup_source) {
+		close(ft->wakeup_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+WL_EXPORT void
+weston_frame_timer_release(struct weston_frame_timer *ft)
+{
+	if (ft->timer)
+		wl_event_source_remove(ft->timer);
+	if (ft->idle_source)
+		wl_event_source_remove(ft->idle_source);
+	if (ft->wakeup_source)
+		wl_event_source_remove(ft->wakeup_source);
+	if (ft->wakeup_fd >= 0)
+		close(ft->wakeup_fd);
+
+	ft->timer = NULL;
+	ft->idle_source = NULL;
+	ft->wakeup_source = NULL;
+	ft->wakeup_fd = -1;
+}
+
+/* Starts a frame now, to be called from start_repaint_loop and when the
+ * timer fires. */
+WL_EXPORT void
+weston_frame_timer_finish_frame(struct weston_frame_timer *ft)
+{
+	uint32_t msec;
+
+	clock_gettime(CLOCK_MONOTONIC, &ft->frame_start);
+	msec = ft->frame_start.tv_sec * 1000 +
+		ft->frame_start.tv_nsec / 1000000;
+	weston_output_finish_frame(ft->output, msec);
+}
+
+/* Arms the next frame, to be called at the end of the repaint. The
+ * period counts from the start of the frame, so the time spent
+ * repainting does not lower the frame rate. */
+WL_EXPORT void
+weston_frame_timer_schedule(struct weston_frame_timer *ft)
+{
+	struct timespec now;
+	int64_t elapsed, delay;
+	uint64_t one = 1;
+
+	if (ft->refresh <= 0) {
+		if (write(ft->wakeup_fd, &one, sizeof one) != sizeof one)
+			weston_log("failed to wake up the frame timer: %m\n");
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (int64_t) (now.tv_sec - ft->frame_start.tv_sec) * 1000000 +
+		(now.tv_nsec - ft->frame_start.tv_nsec) / 1000;
+	delay = (1000000000LL / ft->refresh - elapsed) / 1000;
+
+	/* A delay of 0 would disarm the timer */
+	wl_event_source_timer_update(ft->timer, delay > 0 ? delay : 1);
+}
+
 static void
 idle_repaint(void *data)
 {
@@ -2032,16 +2585,39 @@ surface_set_input_region(struct wl_client *client,
 	}
 }
 
+/* Both lists hold the same subsurfaces, linking and unlinking one
+ * marks the view list dirty already. */
+static int
+weston_surface_subsurface_order_changed(struct weston_surface *surface)
+{
+	struct wl_list *link = surface->subsurface_list.next;
+	struct weston_subsurface *sub;
+
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (link != &sub->parent_link)
+			return 1;
+		link = link->next;
+	}
+
+	return 0;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	if (!weston_surface_subsurface_order_changed(surface))
+		return;
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 	}
+
+	weston_compositor_view_list_dirty(surface->compositor);
 }
 
 static void
@@ -2075,6 +2651,7 @@ weston_surface_commit(struct weston_surface *surface)
 				       surface->width,
 				       surface->height);
 	empty_region(&surface->pending.damage);
+	surface->compositor->damage_dirty = 1;
 
 	/* wl_surface.set_opaque_region */
 	pixman_region32_init_rect(&opaque, 0, 0,
@@ -2297,6 +2874,7 @@ weston_subsurface_commit_from_cache(struct weston_subsurface *sub)
 				       surface->width,
 				       surface->height);
 	empty_region(&sub->cached.damage);
+	surface->compositor->damage_dirty = 1;
 
 	/* wl_surface.set_opaque_region */
 	pixman_region32_init_rect(&opaque, 0, 0,
@@ -2658,6 +3236,8 @@ weston_subsurface_cache_fini(struct weston_subsurface *sub)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_dirty(sub->surface->compositor);
+
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -2721,6 +3301,8 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_signal_add(&parent->destroy_signal,
 		      &sub->parent_destroy_listener);
 
+	weston_compositor_view_list_dirty(parent->compositor);
+
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
@@ -3005,6 +3587,7 @@ weston_plane_init(struct weston_plane *plane,
 {
 	pixman_region32_init(&plane->damage);
 	pixman_region32_init(&plane->clip);
+	pixman_region32_init(&plane->opaque);
 	plane->x = x;
 	plane->y = y;
 	plane->compositor = ec;
@@ -3021,12 +3604,15 @@ weston_plane_release(struct weston_plane *plane)
 
 	pixman_region32_fini(&plane->damage);
 	pixman_region32_fini(&plane->clip);
+	pixman_region32_fini(&plane->opaque);
 
 	wl_list_for_each(view, &plane->compositor->view_list, link) {
 		if (view->plane == plane)
 			view->plane = NULL;
 	}
 
+	plane->compositor->damage_dirty = 1;
+
 	wl_list_remove(&plane->link);
 }
 
@@ -3039,6 +3625,8 @@ weston_compositor_stack_plane(struct weston_compositor *ec,
 		wl_list_insert(above->link.prev, &plane->link);
 	else
 		wl_list_insert(&ec->plane_list, &plane->link);
+
+	ec->damage_dirty = 1;
 }
 
 static void unbind_resource(struct wl_resource *resource)
@@ -3121,6 +3709,12 @@ weston_output_destroy(struct weston_output *output)
 	wl_signal_emit(&output->compositor->output_destroyed_signal, output);
 	wl_signal_emit(&output->destroy_signal, output);
 
+	if (output->timing_ring) {
+		weston_output_dump_frame_timing(output);
+		weston_frame_timing_ring_destroy(output->timing_ring);
+		output->timing_ring = NULL;
+	}
+
 	free(output->name);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
@@ -3305,6 +3899,8 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	weston_output_init_geometry(output, x, y);
 	weston_output_damage(output);
 
+	memset(output->plugin_data, 0, sizeof output->plugin_data);
+
 	wl_signal_init(&output->frame_signal);
 	wl_signal_init(&output->destroy_signal);
 	wl_list_init(&output->animation_list);
@@ -3313,6 +3909,14 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	output->id = ffs(~output->compositor->output_id_pool) - 1;
 	output->compositor->output_id_pool |= 1 << output->id;
 
+	output->timing_ring = NULL;
+	if (c->frame_timing_log) {
+		output->timing_ring =
+			weston_frame_timing_ring_create(c->frame_timing_size);
+		if (!output->timing_ring)
+			weston_log("failed to allocate frame timing ring\n");
+	}
+
 	output->global =
 		wl_global_create(c->wl_display, &wl_output_interface, 2,
 				 output, bind_output);
@@ -3619,6 +4223,26 @@ weston_environment_get_fd(const char *env)
 	return fd;
 }
 
+static void
+frame_timing_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
+		     void *data)
+{
+	struct weston_compositor *ec = data;
+	struct weston_output *output;
+	int n;
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		n = weston_output_dump_frame_timing(output);
+		if (n >= 0)
+			weston_log("frame timing: wrote %d frames of output "
+				   "%u to %s\n", n, output->id,
+				   ec->frame_timing_log);
+	}
+
+	log_plugin_hook_calls(ec);
+	wl_signal_emit(&ec->frame_timing_signal, ec);
+}
+
 WL_EXPORT int
 weston_compositor_init(struct weston_compositor *ec,
 		       struct wl_display *display,
@@ -3646,6 +4270,7 @@ weston_compositor_init(struct weston_compositor *ec,
 	wl_signal_init(&ec->output_destroyed_signal);
 	wl_signal_init(&ec->output_moved_signal);
 	wl_signal_init(&ec->session_signal);
+	wl_signal_init(&ec->frame_timing_signal);
 	ec->session_active = 1;
 
 	ec->output_id_pool = 0;
@@ -3663,6 +4288,13 @@ weston_compositor_init(struct weston_compositor *ec,
 		return -1;
 
 	wl_list_init(&ec->view_list);
+	wl_array_init(&ec->view_list_order);
+	ec->view_list_dirty = 1;
+
+	ec->pick_grid = calloc(PICK_GRID_BUCKETS, sizeof *ec->pick_grid);
+	if (!ec->pick_grid)
+		return -1;
+	wl_array_init(&ec->pick_unbounded);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -3693,6 +4325,18 @@ weston_compositor_init(struct weston_compositor *ec,
 	if (weston_compositor_xkb_init(ec, &xkb_names) < 0)
 		return -1;
 
+	s = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_string(s, "frame-timing-log",
+					 &ec->frame_timing_log, NULL);
+	weston_config_section_get_int(s, "frame-timing-frames",
+				      &ec->frame_timing_size, 1024);
+	if (ec->frame_timing_log) {
+		if (ec->frame_timing_size < 1)
+			ec->frame_timing_size = 1024;
+		weston_compositor_add_debug_binding(ec, KEY_T,
+						    frame_timing_binding, ec);
+	}
+
 	text_backend_init(ec);
 
 	wl_data_device_manager_init(ec->wl_display);
@@ -3724,12 +4368,16 @@ unload_plugins(struct weston_compositor *ec) {
 		free(plugin->name);
 		free(plugin);
 	}
+
+	ec->plugin_hooks = 0;
+	ec->plugin_unfiltered_hooks = 0;
 }
 
 WL_EXPORT void
 weston_compositor_shutdown(struct weston_compositor *ec)
 {
 	struct weston_output *output, *next;
+	int i;
 
 	wl_event_source_remove(ec->idle_source);
 	if (ec->input_loop_source)
@@ -3752,6 +4400,15 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	weston_plane_release(&ec->primary_plane);
 
+	wl_array_release(&ec->view_list_order);
+
+	for (i = 0; i < PICK_GRID_BUCKETS; i++)
+		wl_array_release(&ec->pick_grid[i]);
+	free(ec->pick_grid);
+	wl_array_release(&ec->pick_unbounded);
+
+	free(ec->frame_timing_log);
+
 	wl_event_loop_destroy(ec->input_loop);
 
 	weston_config_destroy(ec->config);
@@ -3978,8 +4635,49 @@ load_modules(struct weston_compositor *ec, const char *modules,
 	return 0;
 }
 
+/* Reserves a slot in weston_view::plugin_data and
+ * weston_output::plugin_data for a plugin, usually from its init hook.
+ * Returns the slot index, or -1 when all slots are taken.
+ */
+WL_EXPORT int
+weston_plugin_slot_alloc(struct weston_compositor *compositor)
+{
+	int slot;
+
+	slot = ffs(~compositor->plugin_slots) - 1;
+	if (slot < 0 || slot >= WESTON_PLUGIN_MAX_SLOTS) {
+		weston_log("no free plugin data slot\n");
+		return -1;
+	}
+
+	compositor->plugin_slots |= 1 << slot;
+
+	return slot;
+}
+
+/* The plugin must have released whatever it kept in the slot. */
+WL_EXPORT void
+weston_plugin_slot_free(struct weston_compositor *compositor, int slot)
+{
+	compositor->plugin_slots &= ~(1 << slot);
+}
+
+/* Per-view hooks only run for views with plugin data set, so plugins
+ * with a slot must attach their view state through here. */
+WL_EXPORT void
+weston_view_set_plugin_data(struct weston_view *view, int slot, void *data)
+{
+	view->plugin_data[slot] = data;
+	if (data)
+		view->plugin_slots |= 1 << slot;
+	else
+		view->plugin_slots &= ~(1 << slot);
+}
+
 static int
-add_plugin(struct wl_list *list, struct weston_plugin_interface *interface, char *name)
+add_plugin(struct weston_compositor *ec,
+	   struct weston_plugin_interface *interface, char *name,
+	   uint32_t slots)
 {
 	struct weston_plugin *plugin;
 
@@ -3990,8 +4688,14 @@ add_plugin(struct wl_list *list, struct weston_plugin_interface *interface, char
 
 	plugin->name = strdup(name);
 	plugin->interface = interface;
+	plugin->hooks = plugin_hook_mask(interface);
+	plugin->slots = slots;
+
+	ec->plugin_hooks |= plugin->hooks;
+	if (!slots)
+		ec->plugin_unfiltered_hooks |= plugin->hooks;
 
-	wl_list_insert(list, &plugin->link);
+	wl_list_insert(&ec->plugin_list, &plugin->link);
 
 	return 0;
 }
@@ -4003,6 +4707,7 @@ load_plugins(struct weston_compositor *ec, const char *plugins,
 	const char *p, *end;
 	char buffer[32];
 	struct weston_plugin_interface *plugin_interface = NULL;
+	uint32_t slots;
 
 	if (plugins == NULL)
 		return 0;
@@ -4021,8 +4726,11 @@ load_plugins(struct weston_compositor *ec, const char *plugins,
 				weston_log("Failed to initialize %s plugin\n", buffer);
 				goto next;
 			}
+			slots = ec->plugin_slots;
 			if (!plugin_interface->init(ec)) {
-				if(!add_plugin(&ec->plugin_list, plugin_interface, buffer))
+				slots = ec->plugin_slots & ~slots;
+				if (!add_plugin(ec, plugin_interface, buffer,
+						slots))
 					weston_log("Loaded %s plugin\n", buffer);
 			}
 		}
@@ -4133,6 +4841,13 @@ usage(int error_code)
 		"  --sprawl\t\tCreate one fullscreen output for every parent output\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 
+	fprintf(stderr,
+		"Options for headless-backend.so:\n\n"
+		"  --width=WIDTH\t\tWidth of memory surface\n"
+		"  --height=HEIGHT\tHeight of memory surface\n"
+		"  --refresh-rate=HZ\tFrame rate, 0 for no limit\n"
+		"  --use-pixman\t\tUse the pixman (CPU) renderer\n\n");
+
 #if defined(BUILD_RPI_COMPOSITOR) && defined(HAVE_BCM_HOST)
 	fprintf(stderr,
 		"Options for rpi-backend.so:\n\n"
@@ -4150,10 +4865,13 @@ usage(int error_code)
        "Options for rdp-backend.so:\n\n"
        "  --width=WIDTH\t\tWidth of desktop\n"
        "  --height=HEIGHT\tHeight of desktop\n"
+       "  --refresh-rate=HZ\tFrame rate, 0 for no limit\n"
        "  --env-socket=SOCKET\tUse that socket as peer connection\n"
        "  --address=ADDR\tThe address to bind\n"
        "  --port=PORT\tThe port to listen on\n"
        "  --no-clients-resize\tThe RDP peers will be forced to the size of the desktop\n"
+       "  --tile-diff\t\tOnly send the tiles whose content changed\n"
+       "  --encoder-threads=N\tEncode large updates on N worker threads\n"
        "  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
        "  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
        "  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
@@ -28,6 +28,7 @@
 extern "C" {
 #endif
 
+#include <time.h>
 #include <pixman.h>
 #include <xkbcommon/xkbcommon.h>
 
@@ -49,6 +50,13 @@ extern "C" {
 	const __typeof__( ((type *)0)->member ) *__mptr = (ptr);	\
 	(type *)( (char *)__mptr - offsetof(type,member) );})
 
+/* Number of plugins that may keep state in weston_view::plugin_data and
+ * weston_output::plugin_data, see weston_plugin_slot_alloc(). */
+#define WESTON_PLUGIN_MAX_SLOTS 8
+
+/* Upper bound of the number of hooks in weston_plugin_interface. */
+#define WESTON_PLUGIN_MAX_HOOKS 32
+
 struct weston_transform {
 	struct weston_matrix matrix;
 	struct wl_list link;
@@ -122,6 +130,9 @@ struct weston_animation {
 	struct wl_list link;
 };
 
+/* Returns the animation time in milliseconds. */
+typedef uint32_t (*weston_animation_clock_func_t)(void *data);
+
 enum {
 	WESTON_SPRING_OVERSHOOT,
 	WESTON_SPRING_CLAMP,
@@ -153,11 +164,61 @@ enum weston_mode_switch_op {
 	WESTON_MODE_SWITCH_RESTORE_NATIVE
 };
 
+/* Timing of one weston_output_repaint(). The stage fields are
+ * CLOCK_MONOTONIC timestamps in ns taken at the end of each stage.
+ */
+struct weston_frame_timing {
+	uint32_t msecs;			/* frame time given to clients */
+	uint64_t begin;
+	uint64_t view_list;
+	uint64_t assign_planes;
+	uint64_t accumulate_damage;
+	uint64_t repaint;		/* backend and renderer */
+	uint64_t frame_callbacks;
+
+	uint32_t damage_area;		/* pixels */
+	uint32_t damage_rects;
+	uint32_t views_drawn;		/* primary plane views hit by damage */
+	uint32_t region_ops;
+	uint32_t view_list_rebuilt;
+	uint32_t plugin_calls;		/* plugin hooks dispatched */
+};
+
+struct weston_frame_timing_ring;
+
+/* Paces the repaint loop of an output that has no display to sync to,
+ * like the headless and RDP ones. Frame times come from the monotonic
+ * clock. */
+struct weston_frame_timer {
+	struct weston_output *output;
+	int32_t refresh;		/* mHz, 0 repaints as fast as possible */
+	struct timespec frame_start;
+
+	struct wl_event_source *timer;
+	int wakeup_fd;
+	struct wl_event_source *wakeup_source;
+	struct wl_event_source *idle_source;
+};
+
+/* Shrinks the damage handed to a remote encoder to the tiles whose
+ * content actually changed, for clients that damage more than they
+ * draw. Keeps a hash of every tile of the last image it was given. */
+struct weston_tile_diff {
+	int tile_size;
+	int width, height;
+	int columns, rows;
+	uint64_t *hashes;
+
+	uint64_t damage_bytes;		/* damage passed in */
+	uint64_t changed_bytes;		/* damage kept */
+};
+
 struct weston_output {
 	uint32_t id;
 	char *name;
 
 	void *renderer_state;
+	void *plugin_data[WESTON_PLUGIN_MAX_SLOTS];
 
 	struct wl_list link;
 	struct wl_list resource_list;
@@ -169,6 +230,8 @@ struct weston_output {
 	int32_t mm_width, mm_height;
 	pixman_region32_t region;
 	pixman_region32_t previous_damage;
+	uint32_t repaint_region_ops; /* damage region ops, last repaint */
+	struct weston_frame_timing_ring *timing_ring; /* NULL if disabled */
 	int repaint_needed;
 	int repaint_scheduled;
 	int dirty;
@@ -514,6 +577,7 @@ struct weston_plane {
 	struct weston_compositor *compositor;
 	pixman_region32_t damage;
 	pixman_region32_t clip;
+	pixman_region32_t opaque; /* scratch for damage accumulation */
 	int32_t x, y;
 	struct wl_list link;
 };
@@ -587,6 +651,10 @@ struct weston_compositor {
 	struct wl_list view_list;
 	struct wl_list plane_list;
 	struct wl_list plugin_list;
+	uint32_t plugin_slots;		/* see weston_plugin_slot_alloc() */
+	uint32_t plugin_hooks;		/* hooks any plugin implements */
+	uint32_t plugin_unfiltered_hooks; /* by plugins without a slot */
+	uint64_t plugin_hook_calls[WESTON_PLUGIN_MAX_HOOKS];
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
 	struct wl_list button_binding_list;
@@ -601,6 +669,42 @@ struct weston_compositor {
 
 	const struct weston_pointer_grab_interface *default_pointer_grab;
 
+	/* View list state, see weston_compositor_build_view_list().
+	 * view_list_order caches the top-level views in layer order as of
+	 * the last full rebuild, view_list_dirty forces the next rebuild.
+	 */
+	int view_list_dirty;
+	struct wl_array view_list_order;
+	uint32_t view_list_rebuilds;
+	uint32_t view_list_reuses;
+
+	/* Uniform grid over view_list for weston_compositor_pick_view().
+	 * Each bucket holds the views overlapping the cells hashed to it,
+	 * sorted by weston_view::pick.order.
+	 */
+	struct wl_array *pick_grid;
+	struct wl_array pick_unbounded;
+
+	/* Damage accumulation state. damage_dirty is set whenever surface
+	 * damage, view geometry or plane assignment changed since the view
+	 * clips and plane damage were last computed.
+	 */
+	int damage_dirty;
+	uint32_t damage_region_ops;
+
+	/* Frame timing instrumentation, enabled by frame-timing-log in
+	 * the core section. */
+	int32_t frame_timing_size;
+	char *frame_timing_log;
+	/* Emitted when the frame timing binding writes the rings, for
+	 * backends and modules to log their own counters along. */
+	struct wl_signal frame_timing_signal;
+
+	/* Clock the animations are stepped by, the monotonic clock
+	 * unless set with weston_compositor_set_animation_clock(). */
+	weston_animation_clock_func_t animation_clock;
+	void *animation_clock_data;
+
 	/* Repaint state. */
 	struct weston_plane primary_plane;
 	uint32_t capabilities; /* combination of enum weston_capability */
@@ -634,13 +738,26 @@ struct weston_compositor {
 		p->interface->f(__VA_ARGS__);				\
 })
 /* WESTON_PLUGIN_CALL(compositor, function, arguments to function)
- * Calls function for each plugin in the list
- * Functions are defined in weston_plugin_interface below */
+ * Calls function for each plugin in the list, unless no plugin
+ * implements it. Functions are defined in weston_plugin_interface below */
 #define WESTON_PLUGIN_CALL(c, f, ...) ({				\
 	struct weston_plugin *p;					\
 									\
-	wl_list_for_each(p, &(c)->plugin_list, link)			\
-		WESTON_PLUGIN_CALL_SINGLE(p, f, __VA_ARGS__);		\
+	if ((c)->plugin_hooks & (1u << WESTON_PLUGIN_HOOK(f))) {	\
+		(c)->plugin_hook_calls[WESTON_PLUGIN_HOOK(f)]++;	\
+		wl_list_for_each(p, &(c)->plugin_list, link)		\
+			WESTON_PLUGIN_CALL_SINGLE(p, f, __VA_ARGS__);	\
+	}								\
+})
+/* WESTON_PLUGIN_CALL_VIEW(compositor, function, view, more arguments)
+ * WESTON_PLUGIN_CALL for hooks about a single view. Views no plugin
+ * keeps data for are skipped, unless a plugin without a data slot
+ * implements the hook and has to see every view. */
+#define WESTON_PLUGIN_CALL_VIEW(c, f, v, ...) ({			\
+	if ((v)->plugin_slots ||					\
+	    ((c)->plugin_unfiltered_hooks &				\
+	     (1u << WESTON_PLUGIN_HOOK(f))))				\
+		WESTON_PLUGIN_CALL(c, f, v, ##__VA_ARGS__);		\
 })
 
 struct weston_plugin;
@@ -663,12 +780,26 @@ struct weston_plugin_interface {
 	void (*compute_bbox)(struct weston_view *view, pixman_region32_t *bbox);
 };
 
+/* Index of hook f in weston_plugin_interface, its bit in the hook masks. */
+#define WESTON_PLUGIN_HOOK(f)						\
+	(offsetof(struct weston_plugin_interface, f) /			\
+	 sizeof(void (*)(void)))
+
 struct weston_plugin {
 	char *name;
 	struct weston_plugin_interface *interface;
+	uint32_t hooks;			/* bits of the hooks implemented */
+	uint32_t slots;			/* data slots taken by init */
 	struct wl_list link;
 };
 
+int
+weston_plugin_slot_alloc(struct weston_compositor *compositor);
+void
+weston_plugin_slot_free(struct weston_compositor *compositor, int slot);
+void
+weston_view_set_plugin_data(struct weston_view *view, int slot, void *data);
+
 struct weston_buffer {
 	struct wl_resource *resource;
 	struct wl_signal destroy_signal;
@@ -812,6 +943,12 @@ struct weston_view {
 
 	void *renderer_state;
 
+	/* Per plugin state, indexed by weston_plugin_slot_alloc() slot.
+	 * Set it with weston_view_set_plugin_data(), plugin_slots has a
+	 * bit for each slot in use. */
+	void *plugin_data[WESTON_PLUGIN_MAX_SLOTS];
+	uint32_t plugin_slots;
+
 	/* Surface geometry state, mutable.
 	 * If you change anything, call weston_surface_geometry_dirty().
 	 * That includes the transformations referenced from the list.
@@ -860,6 +997,18 @@ struct weston_view {
 	 * displayed on.
 	 */
 	uint32_t output_mask;
+
+	/* Entry in the compositor's pick index, managed by the compositor.
+	 * order is the position in weston_compositor::view_list and box the
+	 * area covered in the index. Unbounded views accept input outside
+	 * of their bounding box and are always tested.
+	 */
+	struct {
+		int indexed;
+		int unbounded;
+		uint32_t order;
+		pixman_box32_t box;
+	} pick;
 };
 
 struct weston_surface {
@@ -1000,6 +1149,13 @@ weston_spring_update(struct weston_spring *spring, uint32_t msec);
 int
 weston_spring_done(struct weston_spring *spring);
 
+uint32_t
+weston_compositor_get_animation_time(struct weston_compositor *ec);
+void
+weston_compositor_set_animation_clock(struct weston_compositor *ec,
+				      weston_animation_clock_func_t clock,
+				      void *data);
+
 void
 weston_surface_activate(struct weston_surface *surface,
 			struct weston_seat *seat);
@@ -1041,6 +1197,9 @@ notify_touch_frame(struct weston_seat *seat);
 void
 weston_layer_init(struct weston_layer *layer, struct wl_list *below);
 
+void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor);
+
 void
 weston_plane_init(struct weston_plane *plane,
 			struct weston_compositor *ec,
@@ -1055,6 +1214,50 @@ weston_compositor_stack_plane(struct weston_compositor *ec,
 
 void
 weston_output_finish_frame(struct weston_output *output, uint32_t msecs);
+struct weston_frame_timing_ring *
+weston_frame_timing_ring_create(uint32_t size);
+void
+weston_frame_timing_ring_destroy(struct weston_frame_timing_ring *ring);
+void
+weston_frame_timing_ring_push(struct weston_frame_timing_ring *ring,
+			      const struct weston_frame_timing *timing);
+int
+weston_frame_timing_ring_read(struct weston_frame_timing_ring *ring,
+			      struct weston_frame_timing *timings,
+			      uint32_t *serial, int max);
+uint64_t
+weston_frame_timing_now(void);
+int
+weston_output_dump_frame_timing(struct weston_output *output);
+
+struct weston_worker_pool;
+typedef void (*weston_worker_func_t)(void *data, int item);
+
+struct weston_worker_pool *
+weston_worker_pool_create(int num_threads);
+void
+weston_worker_pool_destroy(struct weston_worker_pool *pool);
+int
+weston_worker_pool_get_num_threads(struct weston_worker_pool *pool);
+void
+weston_worker_pool_run(struct weston_worker_pool *pool, int count,
+		       weston_worker_func_t func, void *data);
+int
+weston_frame_timer_init(struct weston_frame_timer *ft,
+			struct weston_output *output, int32_t refresh);
+void
+weston_frame_timer_release(struct weston_frame_timer *ft);
+void
+weston_frame_timer_finish_frame(struct weston_frame_timer *ft);
+void
+weston_frame_timer_schedule(struct weston_frame_timer *ft);
+void
+weston_tile_diff_init(struct weston_tile_diff *td, int tile_size);
+void
+weston_tile_diff_release(struct weston_tile_diff *td);
+void
+weston_tile_diff_filter(struct weston_tile_diff *td, pixman_image_t *image,
+			pixman_region32_t *damage);
 void
 weston_output_schedule_repaint(struct weston_output *output);
 void
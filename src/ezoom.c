@@ -50,7 +50,8 @@ struct ezoom_output {
 
 struct {
 	struct weston_compositor *compositor;
-	struct wl_list output_list;
+	struct wl_list output_list;	/* only walked on fini */
+	int slot;
 } ezoom;
 
 static struct weston_seat *
@@ -78,14 +79,7 @@ output_contains_point(struct weston_output *output)
 static struct ezoom_output *
 get_output(struct weston_output *output)
 {
-	struct ezoom_output *ezoom_output;
-
-	wl_list_for_each(ezoom_output, &ezoom.output_list, link) {
-		if (ezoom_output->output == output)
-			return ezoom_output;
-	}
-
-	return NULL;
+	return output->plugin_data[ezoom.slot];
 }
 
 static void
@@ -391,8 +385,11 @@ fini(struct weston_compositor *compositor)
 {
 	struct ezoom_output *ezoom_output, *next;
 
+	/* The outputs are gone by now, only free our side. */
 	wl_list_for_each_safe(ezoom_output, next, &ezoom.output_list, link)
 		free(ezoom_output);
+
+	weston_plugin_slot_free(compositor, ezoom.slot);
 }
 
 static int
@@ -404,8 +401,14 @@ init(struct weston_compositor *compositor)
 	ezoom.compositor = compositor;
 	wl_list_init(&ezoom.output_list);
 
+	ezoom.slot = weston_plugin_slot_alloc(compositor);
+	if (ezoom.slot < 0)
+		return -1;
+
 	wl_list_for_each(output, &compositor->output_list, link) {
 		ezoom_output = zalloc(sizeof *ezoom_output);
+		if (!ezoom_output)
+			continue;
 
 		ezoom_output->output = output;
 		ezoom_output->active = 0;
@@ -425,6 +428,7 @@ init(struct weston_compositor *compositor)
 		ezoom_output->motion_listener.notify = motion;
 
 		wl_list_insert(&ezoom.output_list, &ezoom_output->link);
+		output->plugin_data[ezoom.slot] = ezoom_output;
 	}
 
 	return 0;
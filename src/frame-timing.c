@@ -0,0 +1,190 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "compositor.h"
+
+/* Ring of the last frame timings of an output. The repaint loop is the
+ * only writer, readers may run on any thread without taking a lock:
+ * head counts the records written so far and is published after the
+ * record itself, so a reader loads it again once done copying and
+ * drops whatever the writer may have overwritten in the meantime.
+ */
+struct weston_frame_timing_ring {
+	uint32_t size;			/* power of two */
+	uint32_t head;
+	uint32_t dumped;		/* next record for the log file */
+	struct weston_frame_timing timings[];
+};
+
+#define TIMING_READ_CHUNK 64
+
+WL_EXPORT uint64_t
+weston_frame_timing_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+WL_EXPORT struct weston_frame_timing_ring *
+weston_frame_timing_ring_create(uint32_t size)
+{
+	struct weston_frame_timing_ring *ring;
+	uint32_t n = 1;
+
+	while (n < size)
+		n <<= 1;
+
+	ring = zalloc(sizeof *ring + n * sizeof ring->timings[0]);
+	if (!ring)
+		return NULL;
+
+	ring->size = n;
+
+	return ring;
+}
+
+WL_EXPORT void
+weston_frame_timing_ring_destroy(struct weston_frame_timing_ring *ring)
+{
+	free(ring);
+}
+
+WL_EXPORT void
+weston_frame_timing_ring_push(struct weston_frame_timing_ring *ring,
+			      const struct weston_frame_timing *timing)
+{
+	uint32_t head = ring->head;
+
+	ring->timings[head & (ring->size - 1)] = *timing;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies at most max records, oldest first, starting at record number
+ * *serial or the oldest one still in the ring. Returns the number of
+ * records copied and advances *serial past them.
+ */
+WL_EXPORT int
+weston_frame_timing_ring_read(struct weston_frame_timing_ring *ring,
+			      struct weston_frame_timing *timings,
+			      uint32_t *serial, int max)
+{
+	uint32_t head, first, count, skip, i;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	first = *serial;
+	if (head - first > ring->size)
+		first = head - ring->size;
+
+	count = head - first;
+	if (count > (uint32_t) max)
+		count = max;
+
+	for (i = 0; i < count; i++)
+		timings[i] = ring->timings[(first + i) & (ring->size - 1)];
+
+	/* The record being written next overwrites record head - size. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	skip = 0;
+	if (head - first >= ring->size)
+		skip = head - first - ring->size + 1;
+	if (skip > count)
+		skip = count;
+
+	memmove(timings, timings + skip, (count - skip) * sizeof *timings);
+	*serial = first + count;
+
+	return count - skip;
+}
+
+static uint32_t
+timing_us(uint64_t from, uint64_t to)
+{
+	return (to - from) / 1000;
+}
+
+/* Appends the records not written yet to the frame-timing-log file,
+ * one line per frame with the duration of each stage in µs. Returns
+ * the number of records written, or -1 on failure.
+ */
+WL_EXPORT int
+weston_output_dump_frame_timing(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_frame_timing_ring *ring = output->timing_ring;
+	struct weston_frame_timing timings[TIMING_READ_CHUNK], *t;
+	int i, n, total = 0;
+	FILE *fp;
+
+	if (!ring || !ec->frame_timing_log)
+		return 0;
+
+	fp = fopen(ec->frame_timing_log, "a");
+	if (!fp) {
+		weston_log("failed to open %s: %m\n", ec->frame_timing_log);
+		return -1;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	if (ftell(fp) == 0)
+		fprintf(fp, "# output msecs view_list assign_planes "
+			"accumulate_damage repaint frame_callbacks total "
+			"damage_area damage_rects views_drawn region_ops "
+			"view_list_rebuilt plugin_calls\n");
+
+	do {
+		n = weston_frame_timing_ring_read(ring, timings,
+						  &ring->dumped,
+						  TIMING_READ_CHUNK);
+		for (i = 0; i < n; i++) {
+			t = &timings[i];
+			fprintf(fp, "%u %u %u %u %u %u %u %u %u %u %u %u %u "
+				"%u\n",
+				output->id, t->msecs,
+				timing_us(t->begin, t->view_list),
+				timing_us(t->view_list, t->assign_planes),
+				timing_us(t->assign_planes,
+					  t->accumulate_damage),
+				timing_us(t->accumulate_damage, t->repaint),
+				timing_us(t->repaint, t->frame_callbacks),
+				timing_us(t->begin, t->frame_callbacks),
+				t->damage_area, t->damage_rects,
+				t->views_drawn, t->region_ops,
+				t->view_list_rebuilt, t->plugin_calls);
+		}
+		total += n;
+	} while (n > 0);
+
+	fclose(fp);
+
+	return total;
+}
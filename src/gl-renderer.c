@@ -433,7 +433,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 				  ev->surface->width, ev->surface->height);
 	pixman_region32_subtract(&surface_blend, &surface_blend, &ev->surface->opaque);
 
-	WESTON_PLUGIN_CALL(ec, prepare_paint, ev, ms_elapsed, &needs_paint);
+	WESTON_PLUGIN_CALL_VIEW(ec, prepare_paint, ev, ms_elapsed, &needs_paint);
 
 	if (!needs_paint) {
 		if (pixman_region32_not_empty(&surface_blend)) {
@@ -448,9 +448,9 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 				glDisable(GL_BLEND);
 		}
 
-		WESTON_PLUGIN_CALL(ec, add_geometry, ev);
-		WESTON_PLUGIN_CALL(ec, paint_view, ev);
-		WESTON_PLUGIN_CALL(ec, done_paint, ev);
+		WESTON_PLUGIN_CALL_VIEW(ec, add_geometry, ev);
+		WESTON_PLUGIN_CALL_VIEW(ec, paint_view, ev);
+		WESTON_PLUGIN_CALL_VIEW(ec, done_paint, ev);
 		goto skip;
 	}
 
@@ -494,7 +494,7 @@ repaint_views(struct weston_output *output, pixman_region32_t *damage)
 	struct weston_view *view;
 	int ms_elapsed, time;
 
-	time = weston_compositor_get_time();
+	time = weston_compositor_get_animation_time(compositor);
 	ms_elapsed = time - gr->last_repaint_timestamp;
 	gr->last_repaint_timestamp = time;
 
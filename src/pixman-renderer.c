@@ -30,16 +30,69 @@
 
 #include <linux/input.h>
 
+/* Horizontal band of the render target, composited by one worker */
+struct pixman_tile {
+	int32_t y, height;
+	pixman_image_t *image;	/* shares the render target bits */
+};
+
+/* More tiles than threads, so a damage region covering only part of
+ * the output still keeps every thread busy. */
+#define TILES_PER_THREAD	4
+#define MIN_TILE_HEIGHT		16
+
+/* Enough for triple buffering */
+#define BUFFER_AGE_MAX 3
+
+struct pixman_buffer_age {
+	pixman_image_t *image;
+	uint32_t frame;		/* last frame painted into image */
+};
+
 struct pixman_output_state {
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
+	uint32_t flags;
+
+	/* In direct mode, the damage of the last frames tells which
+	 * parts of a buffer used again are stale. */
+	uint32_t frame_count;
+	struct pixman_buffer_age buffers[BUFFER_AGE_MAX];
+	pixman_region32_t buffer_damage[BUFFER_AGE_MAX - 1];
+
+	int num_tiles;
+	struct pixman_tile *tiles;
+	pixman_image_t *tiles_target;
+};
+
+/* A composite operation recorded for the tiled renderer. It holds no
+ * images: pixman validates an image on its first composite, which
+ * writes to it, so every tile builds its own over the same pixels.
+ */
+struct pixman_draw_cmd {
+	pixman_op_t op;
+
+	/* Source pixels, or a solid fill of color if data is NULL */
+	uint32_t *data;
+	pixman_format_code_t format;
+	int width, height, stride;
+	pixman_color_t color;
+	pixman_transform_t transform;
+	pixman_filter_t filter;
+
+	int has_mask;
+	pixman_color_t mask;
+
+	struct wl_shm_buffer *shm_buffer;
+	pixman_region32_t region; /* in output coordinates */
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color;	/* when image is a solid fill */
 	struct weston_buffer_reference buffer_ref;
 
 	struct wl_listener buffer_destroy_listener;
@@ -55,6 +108,22 @@ struct pixman_renderer {
 	struct weston_binding *debug_binding;
 
 	struct wl_signal destroy_signal;
+
+	/* Tiled rendering, enabled when num_threads > 0. The main thread
+	 * records the draw commands for a frame, then it and the workers
+	 * pick tiles until all of them are composited.
+	 */
+	struct {
+		int num_threads;
+		struct weston_worker_pool *pool;
+
+		struct wl_array cmds; /* struct pixman_draw_cmd */
+		struct pixman_output_state *po;
+	} tiled;
+};
+
+static const pixman_color_t debug_red = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
 };
 
 static inline struct pixman_output_state *
@@ -63,6 +132,15 @@ get_output_state(struct weston_output *output)
 	return (struct pixman_output_state *)output->renderer_state;
 }
 
+static inline pixman_image_t *
+get_render_target(struct pixman_output_state *po)
+{
+	if (po->flags & PIXMAN_RENDERER_OUTPUT_DIRECT)
+		return po->hw_buffer;
+
+	return po->shadow_image;
+}
+
 static int
 pixman_renderer_create_surface(struct weston_surface *surface);
 
@@ -167,6 +245,167 @@ transform_apply_viewport(pixman_transform_t *transform,
 	pixman_transform_translate(transform, NULL, D2F(src_x), D2F(src_y));
 }
 
+static void
+record_draw_cmd(struct pixman_renderer *pr, struct pixman_surface_state *ps,
+		pixman_transform_t *transform, pixman_filter_t filter,
+		pixman_color_t *mask, pixman_region32_t *region,
+		pixman_op_t pixman_op)
+{
+	struct pixman_draw_cmd *cmd;
+
+	cmd = wl_array_add(&pr->tiled.cmds, sizeof *cmd);
+	if (!cmd) {
+		weston_log("pixman renderer: failed to record draw command\n");
+		return;
+	}
+
+	cmd->op = pixman_op;
+	cmd->data = pixman_image_get_data(ps->image);
+	cmd->shm_buffer = NULL;
+
+	if (cmd->data) {
+		cmd->format = pixman_image_get_format(ps->image);
+		cmd->width = pixman_image_get_width(ps->image);
+		cmd->height = pixman_image_get_height(ps->image);
+		cmd->stride = pixman_image_get_stride(ps->image);
+		cmd->transform = *transform;
+		cmd->filter = filter;
+		if (ps->buffer_ref.buffer)
+			cmd->shm_buffer = ps->buffer_ref.buffer->shm_buffer;
+	} else {
+		/* Solid fill, transformation does not matter */
+		cmd->color = ps->color;
+	}
+
+	cmd->has_mask = mask != NULL;
+	if (mask)
+		cmd->mask = *mask;
+
+	pixman_region32_init(&cmd->region);
+	pixman_region32_copy(&cmd->region, region);
+}
+
+static pixman_image_t *
+create_cmd_source(struct pixman_draw_cmd *cmd)
+{
+	pixman_image_t *image;
+
+	if (!cmd->data)
+		return pixman_image_create_solid_fill(&cmd->color);
+
+	image = pixman_image_create_bits(cmd->format,
+					 cmd->width, cmd->height,
+					 cmd->data, cmd->stride);
+	if (!image)
+		return NULL;
+
+	pixman_image_set_transform(image, &cmd->transform);
+	pixman_image_set_filter(image, cmd->filter, NULL, 0);
+
+	return image;
+}
+
+static void
+draw_tile(struct pixman_renderer *pr, struct pixman_output_state *po,
+	  struct pixman_tile *tile)
+{
+	struct pixman_draw_cmd *cmd;
+	pixman_image_t *src, *mask, *debug_color = NULL;
+	pixman_region32_t clip;
+	int32_t width = pixman_image_get_width(tile->image);
+
+	pixman_region32_init(&clip);
+
+	wl_array_for_each(cmd, &pr->tiled.cmds) {
+		pixman_region32_intersect_rect(&clip, &cmd->region,
+					       0, tile->y,
+					       width, tile->height);
+		if (!pixman_region32_not_empty(&clip))
+			continue;
+
+		src = create_cmd_source(cmd);
+		mask = NULL;
+		if (cmd->has_mask)
+			mask = pixman_image_create_solid_fill(&cmd->mask);
+		if (!src || (cmd->has_mask && !mask)) {
+			weston_log("pixman renderer: failed to create "
+				   "tile images\n");
+			if (src)
+				pixman_image_unref(src);
+			continue;
+		}
+
+		pixman_region32_translate(&clip, 0, -tile->y);
+		pixman_image_set_clip_region32(tile->image, &clip);
+
+		/* SIGBUS protection is per thread */
+		if (cmd->shm_buffer)
+			wl_shm_buffer_begin_access(cmd->shm_buffer);
+
+		pixman_image_composite32(cmd->op,
+					 src, /* src */
+					 mask, /* mask */
+					 tile->image, /* dest */
+					 0, tile->y, /* src_x, src_y */
+					 0, tile->y, /* mask_x, mask_y */
+					 0, 0, /* dest_x, dest_y */
+					 width, tile->height);
+
+		if (cmd->shm_buffer)
+			wl_shm_buffer_end_access(cmd->shm_buffer);
+
+		pixman_image_unref(src);
+		if (mask)
+			pixman_image_unref(mask);
+
+		if (pr->repaint_debug && !debug_color)
+			debug_color = pixman_image_create_solid_fill(&debug_red);
+
+		if (pr->repaint_debug && debug_color)
+			pixman_image_composite32(PIXMAN_OP_OVER,
+						 debug_color, /* src */
+						 NULL /* mask */,
+						 tile->image, /* dest */
+						 0, 0, /* src_x, src_y */
+						 0, 0, /* mask_x, mask_y */
+						 0, 0, /* dest_x, dest_y */
+						 width, tile->height);
+
+		pixman_image_set_clip_region32(tile->image, NULL);
+	}
+
+	if (debug_color)
+		pixman_image_unref(debug_color);
+
+	pixman_region32_fini(&clip);
+}
+
+static void
+draw_tile_item(void *data, int tile)
+{
+	struct pixman_renderer *pr = data;
+
+	draw_tile(pr, pr->tiled.po, &pr->tiled.po->tiles[tile]);
+}
+
+static void
+draw_tiles(struct pixman_renderer *pr, struct pixman_output_state *po)
+{
+	struct pixman_draw_cmd *cmd;
+
+	if (pr->tiled.cmds.size == 0)
+		return;
+
+	pr->tiled.po = po;
+	weston_worker_pool_run(pr->tiled.pool, po->num_tiles,
+			       draw_tile_item, pr);
+	pr->tiled.po = NULL;
+
+	wl_array_for_each(cmd, &pr->tiled.cmds)
+		pixman_region32_fini(&cmd->region);
+	pr->tiled.cmds.size = 0;
+}
+
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
 	       pixman_region32_t *region, pixman_region32_t *surf_region,
@@ -177,10 +416,12 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
 	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	pixman_image_t *target = get_render_target(po);
 	pixman_region32_t final_region;
 	float view_x, view_y;
 	pixman_transform_t transform;
 	pixman_fixed_t fw, fh;
+	pixman_filter_t filter;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
 
@@ -211,9 +452,6 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	/* Convert from global to output coord */
 	region_global_to_output(output, &final_region);
 
-	/* And clip to it */
-	pixman_image_set_clip_region32 (po->shadow_image, &final_region);
-
 	/* Set up the source transformation based on the surface
 	   position, the output position/transform/scale and the client
 	   specified buffer transform/scale */
@@ -332,32 +570,45 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 			       pixman_double_to_fixed(vp->buffer.scale),
 			       pixman_double_to_fixed(vp->buffer.scale));
 
-	pixman_image_set_transform(ps->image, &transform);
-
 	if (ev->transform.enabled || output->current_scale != vp->buffer.scale)
-		pixman_image_set_filter(ps->image, PIXMAN_FILTER_BILINEAR, NULL, 0);
+		filter = PIXMAN_FILTER_BILINEAR;
 	else
-		pixman_image_set_filter(ps->image, PIXMAN_FILTER_NEAREST, NULL, 0);
+		filter = PIXMAN_FILTER_NEAREST;
 
-	if (ps->buffer_ref.buffer)
-		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
-
-	if (ev->alpha < 1.0) {
+	if (ev->alpha < 1.0)
 		mask.alpha = 0xffff * ev->alpha;
+
+	if (pr->tiled.num_threads > 0) {
+		record_draw_cmd(pr, ps, &transform, filter,
+				ev->alpha < 1.0 ? &mask : NULL,
+				&final_region, pixman_op);
+		pixman_region32_fini(&final_region);
+		return;
+	}
+
+	if (ev->alpha < 1.0)
 		mask_image = pixman_image_create_solid_fill(&mask);
-	} else {
+	else
 		mask_image = NULL;
-	}
+
+	/* And clip to it */
+	pixman_image_set_clip_region32 (target, &final_region);
+
+	pixman_image_set_transform(ps->image, &transform);
+	pixman_image_set_filter(ps->image, filter, NULL, 0);
+
+	if (ps->buffer_ref.buffer)
+		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
 
 	pixman_image_composite32(pixman_op,
 				 ps->image, /* src */
 				 mask_image, /* mask */
-				 po->shadow_image, /* dest */
+				 target, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->shadow_image), /* width */
-				 pixman_image_get_height (po->shadow_image) /* height */);
+				 pixman_image_get_width (target), /* width */
+				 pixman_image_get_height (target) /* height */);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
@@ -369,14 +620,14 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		pixman_image_composite32(PIXMAN_OP_OVER,
 					 pr->debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 target, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (target), /* width */
+					 pixman_image_get_height (target) /* height */);
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	pixman_image_set_clip_region32 (target, NULL);
 
 	pixman_region32_fini(&final_region);
 }
@@ -465,17 +716,129 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
 }
 
+/* Adds the parts of the current buffer that were not painted in the
+ * frames since it was last used to 'damage', and records the buffer as
+ * up to date. An unknown buffer is stale as a whole. */
+static void
+output_get_buffer_damage(struct weston_output *output,
+			 pixman_region32_t *damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_buffer_age *entry = &po->buffers[0];
+	uint32_t age = 0;
+	int i;
+
+	for (i = 0; i < BUFFER_AGE_MAX; i++) {
+		if (po->buffers[i].image == po->hw_buffer) {
+			entry = &po->buffers[i];
+			age = po->frame_count - entry->frame;
+			break;
+		}
+
+		if (po->buffers[i].frame < entry->frame)
+			entry = &po->buffers[i];
+	}
+
+	if (age == 0 || age > BUFFER_AGE_MAX) {
+		pixman_region32_copy(damage, &output->region);
+	} else {
+		for (i = 0; i < (int) age - 1; i++)
+			pixman_region32_union(damage, damage,
+					      &po->buffer_damage[i]);
+	}
+
+	if (entry->image != po->hw_buffer) {
+		if (entry->image)
+			pixman_image_unref(entry->image);
+		entry->image = pixman_image_ref(po->hw_buffer);
+	}
+	entry->frame = po->frame_count;
+}
+
+static void
+output_rotate_buffer_damage(struct weston_output *output,
+			    pixman_region32_t *output_damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	int i;
+
+	for (i = BUFFER_AGE_MAX - 2; i >= 1; i--)
+		pixman_region32_copy(&po->buffer_damage[i],
+				     &po->buffer_damage[i - 1]);
+	pixman_region32_copy(&po->buffer_damage[0], output_damage);
+
+	po->frame_count++;
+}
+
+static void
+reset_buffer_ages(struct pixman_output_state *po)
+{
+	int i;
+
+	for (i = 0; i < BUFFER_AGE_MAX; i++) {
+		if (po->buffers[i].image)
+			pixman_image_unref(po->buffers[i].image);
+		po->buffers[i].image = NULL;
+		po->buffers[i].frame = 0;
+	}
+
+	/* Frame 0 marks unused entries */
+	po->frame_count = 1;
+}
+
+static int
+create_tiles(struct pixman_output_state *po, pixman_image_t *target,
+	     int num_tiles);
+
+static void
+destroy_tiles(struct pixman_output_state *po);
+
+static void
+repaint_direct(struct weston_output *output, pixman_region32_t *output_damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	pixman_region32_t total_damage;
+
+	/* The tiles alias the bits of the buffer they were made for */
+	if (pr->tiled.num_threads > 0 && po->tiles_target != po->hw_buffer) {
+		destroy_tiles(po);
+		if (create_tiles(po, po->hw_buffer,
+				 (pr->tiled.num_threads + 1) *
+				 TILES_PER_THREAD) < 0)
+			weston_log("pixman renderer: failed to create tiles\n");
+	}
+
+	pixman_region32_init(&total_damage);
+	output_get_buffer_damage(output, &total_damage);
+	output_rotate_buffer_damage(output, output_damage);
+	pixman_region32_union(&total_damage, &total_damage, output_damage);
+
+	repaint_surfaces(output, &total_damage);
+	if (pr->tiled.num_threads > 0)
+		draw_tiles(pr, po);
+
+	pixman_region32_fini(&total_damage);
+}
+
 static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	if (po->flags & PIXMAN_RENDERER_OUTPUT_DIRECT) {
+		repaint_direct(output, output_damage);
+	} else {
+		repaint_surfaces(output, output_damage);
+		if (pr->tiled.num_threads > 0)
+			draw_tiles(pr, po);
+		copy_to_hw_buffer(output, output_damage);
+	}
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -647,6 +1010,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 	
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -656,11 +1020,38 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	ps->image = pixman_image_create_solid_fill(&color);
 }
 
+static int
+create_tile_workers(struct pixman_renderer *pr, int num_threads)
+{
+	pr->tiled.pool = weston_worker_pool_create(num_threads);
+	if (!pr->tiled.pool)
+		return -1;
+
+	wl_array_init(&pr->tiled.cmds);
+	pr->tiled.num_threads =
+		weston_worker_pool_get_num_threads(pr->tiled.pool);
+
+	return 0;
+}
+
+static void
+destroy_tile_workers(struct pixman_renderer *pr)
+{
+	if (pr->tiled.num_threads == 0)
+		return;
+
+	weston_worker_pool_destroy(pr->tiled.pool);
+	wl_array_release(&pr->tiled.cmds);
+	pr->tiled.pool = NULL;
+	pr->tiled.num_threads = 0;
+}
+
 static void
 pixman_renderer_destroy(struct weston_compositor *ec)
 {
 	struct pixman_renderer *pr = get_renderer(ec);
 
+	destroy_tile_workers(pr);
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
 	free(pr);
@@ -678,11 +1069,7 @@ debug_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color = pixman_image_create_solid_fill(&debug_red);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -693,6 +1080,8 @@ WL_EXPORT int
 pixman_renderer_init(struct weston_compositor *ec)
 {
 	struct pixman_renderer *renderer;
+	struct weston_config_section *section;
+	int32_t num_threads;
 
 	renderer = calloc(1, sizeof *renderer);
 	if (renderer == NULL)
@@ -718,6 +1107,19 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_int(section, "pixman-threads",
+				      &num_threads, 0);
+	if (num_threads > 0) {
+		if (create_tile_workers(renderer, num_threads) < 0)
+			weston_log("pixman renderer: failed to start "
+				   "worker threads, rendering serially\n");
+		else
+			weston_log("pixman renderer: compositing tiles on "
+				   "%d worker threads\n",
+				   renderer->tiled.num_threads);
+	}
+
 	return 0;
 }
 
@@ -736,15 +1138,109 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 	}
 }
 
+static void
+destroy_tiles(struct pixman_output_state *po)
+{
+	int i;
+
+	for (i = 0; i < po->num_tiles; i++)
+		pixman_image_unref(po->tiles[i].image);
+	free(po->tiles);
+	po->tiles = NULL;
+	po->num_tiles = 0;
+
+	if (po->tiles_target)
+		pixman_image_unref(po->tiles_target);
+	po->tiles_target = NULL;
+}
+
+static int
+create_tiles(struct pixman_output_state *po, pixman_image_t *target,
+	     int num_tiles)
+{
+	pixman_format_code_t format = pixman_image_get_format(target);
+	uint8_t *bits = (uint8_t *) pixman_image_get_data(target);
+	int stride = pixman_image_get_stride(target);
+	int w = pixman_image_get_width(target);
+	int h = pixman_image_get_height(target);
+	int32_t y = 0, height;
+	int i;
+
+	if (!bits)
+		return -1;
+
+	if (h / num_tiles < MIN_TILE_HEIGHT)
+		num_tiles = h / MIN_TILE_HEIGHT > 0 ? h / MIN_TILE_HEIGHT : 1;
+
+	po->tiles = calloc(num_tiles, sizeof *po->tiles);
+	if (!po->tiles)
+		return -1;
+
+	for (i = 0; i < num_tiles; i++) {
+		height = (h - y) / (num_tiles - i);
+		po->tiles[i].y = y;
+		po->tiles[i].height = height;
+		po->tiles[i].image =
+			pixman_image_create_bits(format, w, height,
+						 (uint32_t *) (bits + y * stride),
+						 stride);
+		if (!po->tiles[i].image) {
+			po->num_tiles = i;
+			destroy_tiles(po);
+			return -1;
+		}
+		y += height;
+	}
+
+	po->num_tiles = num_tiles;
+	po->tiles_target = pixman_image_ref(target);
+
+	return 0;
+}
+
+/* Returns the image holding the last frame rendered for the output, in
+ * buffer coordinates, or NULL if the output is not painted by the pixman
+ * renderer. Only valid until the next repaint of the output.
+ */
+WL_EXPORT pixman_image_t *
+pixman_renderer_output_get_image(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct pixman_output_state *po;
+
+	if (!ec->renderer || ec->renderer->destroy != pixman_renderer_destroy)
+		return NULL;
+
+	po = get_output_state(output);
+	if (!po || !po->hw_buffer)
+		return NULL;
+
+	return get_render_target(po);
+}
+
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = calloc(1, sizeof *po);
-	int w, h;
+	int w, h, i;
 
 	if (!po)
 		return -1;
 
+	po->flags = flags;
+
+	if (flags & PIXMAN_RENDERER_OUTPUT_DIRECT) {
+		/* Tiles are made once the buffer is known */
+		for (i = 0; i < BUFFER_AGE_MAX - 1; i++)
+			pixman_region32_init(&po->buffer_damage[i]);
+		reset_buffer_ages(po);
+
+		output->renderer_state = po;
+
+		return 0;
+	}
+
 	/* set shadow image transformation */
 	w = output->current_mode->width;
 	h = output->current_mode->height;
@@ -766,6 +1262,14 @@ pixman_renderer_output_create(struct weston_output *output)
 		return -1;
 	}
 
+	if (pr->tiled.num_threads > 0 && create_tiles(po, po->shadow_image,
+		    (pr->tiled.num_threads + 1) * TILES_PER_THREAD) < 0) {
+		pixman_image_unref(po->shadow_image);
+		free(po->shadow_buffer);
+		free(po);
+		return -1;
+	}
+
 	output->renderer_state = po;
 
 	return 0;
@@ -775,8 +1279,18 @@ WL_EXPORT void
 pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	int i;
+
+	destroy_tiles(po);
 
-	pixman_image_unref(po->shadow_image);
+	if (po->flags & PIXMAN_RENDERER_OUTPUT_DIRECT) {
+		reset_buffer_ages(po);
+		for (i = 0; i < BUFFER_AGE_MAX - 1; i++)
+			pixman_region32_fini(&po->buffer_damage[i]);
+	} else {
+		pixman_image_unref(po->shadow_image);
+		free(po->shadow_buffer);
+	}
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
@@ -27,11 +27,21 @@
 int
 pixman_renderer_init(struct weston_compositor *ec);
 
+enum pixman_renderer_output_flags {
+	/* The buffers handed to pixman_renderer_output_set_buffer() are
+	 * plain cached memory, paint into them instead of a shadow
+	 * image. */
+	PIXMAN_RENDERER_OUTPUT_DIRECT = (1 << 0),
+};
+
 int
-pixman_renderer_output_create(struct weston_output *output);
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags);
 
 void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer);
 
+pixman_image_t *
+pixman_renderer_output_get_image(struct weston_output *output);
+
 void
 pixman_renderer_output_destroy(struct weston_output *output);
@@ -36,9 +36,13 @@
 #include <wayland-client.h>
 
 #include "compositor.h"
+#include "pixman-renderer.h"
 #include "../shared/os-compatibility.h"
 #include "fullscreen-shell-client-protocol.h"
 
+/* Upper bound of the screen-share-buffers option */
+#define SS_MAX_BUFFERS 8
+
 struct shared_output {
 	struct weston_output *output;
 	struct wl_listener output_destroyed;
@@ -64,13 +68,33 @@ struct shared_output {
 		int32_t width, height;
 
 		struct wl_list buffers;
-		struct wl_list free_buffers;
+		struct wl_list free_buffers;	/* oldest release first */
+
+		/* At most max_buffers of the current size exist at a time.
+		 * The damage of the last frames committed, newest first,
+		 * tells which parts of a buffer painted before are stale.
+		 */
+		int max_buffers;
+		int count;
+		uint32_t frame_count;
+		pixman_region32_t damage;	/* since the last commit */
+		pixman_region32_t history[SS_MAX_BUFFERS - 1];
+
+		/* Statistics, logged when sharing stops */
+		int peak_count;
+		uint32_t frames;
+		uint32_t waits;
+		uint64_t damage_area;
+		uint64_t repaint_area;
 	} shm;
 
 	int cache_dirty;
 	pixman_image_t *cache_image;
 	uint32_t *tmp_data;
 	size_t tmp_data_size;
+
+	int use_tile_diff;
+	struct weston_tile_diff tile_diff;
 };
 
 struct ss_seat {
@@ -96,7 +120,7 @@ struct ss_shm_buffer {
 	struct wl_buffer *buffer;
 	void *data;
 	size_t size;
-	pixman_region32_t damage;
+	uint32_t frame;		/* last frame painted, 0 if none */
 
 	pixman_image_t *pm_image;
 };
@@ -363,20 +387,25 @@ ss_shm_buffer_destroy(struct ss_shm_buffer *buffer)
 	wl_buffer_destroy(buffer->buffer);
 	munmap(buffer->data, buffer->size);
 
-	pixman_region32_fini(&buffer->damage);
-
 	wl_list_remove(&buffer->link);
 	wl_list_remove(&buffer->free_link);
 	free(buffer);
 }
 
+static void
+shared_output_update(struct shared_output *so);
+
 static void
 buffer_release(void *data, struct wl_buffer *buffer)
 {
 	struct ss_shm_buffer *sb = data;
+	struct shared_output *so = sb->output;
 
-	if (sb->output) {
-		wl_list_insert(&sb->output->shm.free_buffers, &sb->free_link);
+	if (so) {
+		wl_list_insert(so->shm.free_buffers.prev, &sb->free_link);
+
+		/* A frame may be waiting for a buffer */
+		shared_output_update(so);
 	} else {
 		ss_shm_buffer_destroy(sb);
 	}
@@ -386,35 +415,50 @@ static const struct wl_buffer_listener buffer_listener = {
 	buffer_release
 };
 
-static struct ss_shm_buffer *
-shared_output_get_shm_buffer(struct shared_output *so)
+/* If the size of the output changed, we free the old buffers and
+ * make new ones. */
+static void
+shared_output_check_shm_size(struct shared_output *so)
 {
 	struct ss_shm_buffer *sb, *bnext;
+
+	if (so->shm.width == so->output->width &&
+	    so->shm.height == so->output->height)
+		return;
+
+	/* Destroy free buffers */
+	wl_list_for_each_safe(sb, bnext, &so->shm.free_buffers, free_link)
+		ss_shm_buffer_destroy(sb);
+
+	/* Orphan in-use buffers so they get destroyed */
+	wl_list_for_each(sb, &so->shm.buffers, link)
+		sb->output = NULL;
+
+	so->shm.count = 0;
+	so->shm.width = so->output->width;
+	so->shm.height = so->output->height;
+}
+
+/* Returns the buffer released the longest ago, or a new one while the
+ * pool is below max_buffers. NULL with *busy set means all buffers are
+ * held by the parent, NULL alone is an error.
+ */
+static struct ss_shm_buffer *
+shared_output_get_shm_buffer(struct shared_output *so, int *busy)
+{
+	struct ss_shm_buffer *sb;
 	struct wl_shm_pool *pool;
 	int width, height, stride;
 	int fd;
 	unsigned char *data;
 
-	width = so->output->width;
-	height = so->output->height;
-	stride = width * 4;
-
-	/* If the size of the output changed, we free the old buffers and
-	 * make new ones. */
-	if (so->shm.width != width ||
-	    so->shm.height != height) {
-
-		/* Destroy free buffers */
-		wl_list_for_each_safe(sb, bnext, &so->shm.free_buffers, link)
-			ss_shm_buffer_destroy(sb);
+	*busy = 0;
 
-		/* Orphan in-use buffers so they get destroyed */
-		wl_list_for_each(sb, &so->shm.buffers, link)
-			sb->output = NULL;
+	shared_output_check_shm_size(so);
 
-		so->shm.width = width;
-		so->shm.height = height;
-	}
+	width = so->shm.width;
+	height = so->shm.height;
+	stride = width * 4;
 
 	if (!wl_list_empty(&so->shm.free_buffers)) {
 		sb = container_of(so->shm.free_buffers.next,
@@ -425,6 +469,11 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		return sb;
 	}
 
+	if (so->shm.count >= so->shm.max_buffers) {
+		*busy = 1;
+		return NULL;
+	}
+
 	fd = os_create_anonymous_file(height * stride);
 	if (fd < 0) {
 		weston_log("os_create_anonymous_file: %m");
@@ -445,8 +494,6 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	wl_list_init(&sb->free_link);
 	wl_list_insert(&so->shm.buffers, &sb->link);
 
-	pixman_region32_init_rect(&sb->damage, 0, 0, width, height);
-
 	sb->data = data;
 	sb->size = height * stride;
 
@@ -468,10 +515,16 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	if (!sb->pm_image)
 		goto out_pixman_error;
 
+	so->shm.count++;
+	if (so->shm.count > so->shm.peak_count)
+		so->shm.peak_count = so->shm.count;
+
 	return sb;
 
 out_pixman_error:
-	pixman_region32_fini(&sb->damage);
+	wl_buffer_destroy(sb->buffer);
+	wl_list_remove(&sb->link);
+	free(sb);
 out_unmap:
 	munmap(data, height * stride);
 out_close:
@@ -589,39 +642,135 @@ static const struct wl_callback_listener shared_output_frame_listener = {
 	shared_output_frame_callback
 };
 
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *r;
+	uint64_t area = 0;
+	int i, nrects;
+
+	r = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; i++)
+		area += (uint64_t) (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	return area;
+}
+
+/* Collects the parts of sb that differ from the frame about to be
+ * committed: the damage since the last commit plus that of the frames
+ * committed after sb was painted, or all of it if sb is too old.
+ */
+static void
+shared_output_buffer_damage(struct shared_output *so,
+			    struct ss_shm_buffer *sb,
+			    pixman_region32_t *damage)
+{
+	uint32_t age = 0;
+	int i;
+
+	if (sb->frame)
+		age = so->shm.frame_count - sb->frame;
+
+	if (age == 0 || age > (uint32_t) so->shm.max_buffers) {
+		pixman_region32_init_rect(damage, 0, 0,
+					  so->shm.width, so->shm.height);
+		return;
+	}
+
+	pixman_region32_init(damage);
+	pixman_region32_copy(damage, &so->shm.damage);
+	for (i = 0; i < (int) age - 1; i++)
+		pixman_region32_union(damage, damage, &so->shm.history[i]);
+}
+
+static void
+shared_output_rotate_damage(struct shared_output *so)
+{
+	int i;
+
+	for (i = so->shm.max_buffers - 2; i >= 1; i--)
+		pixman_region32_copy(&so->shm.history[i],
+				     &so->shm.history[i - 1]);
+	pixman_region32_copy(&so->shm.history[0], &so->shm.damage);
+
+	pixman_region32_clear(&so->shm.damage);
+	so->shm.frame_count++;
+}
+
+/* A reference to the image shared_output_update() copies from: the
+ * pixman renderer's own output image when there is one, the read back
+ * cache otherwise. Looked up on every use as the renderer may swap its
+ * buffers between a repaint and the parent's frame callback.
+ *
+ * The renderer's image is wrapped, as its transform and filter are not
+ * ours to change: fbdev keeps its own rotation on it for the copy to
+ * the hardware.
+ */
+static pixman_image_t *
+shared_output_source_image(struct shared_output *so)
+{
+	pixman_image_t *image;
+
+	image = pixman_renderer_output_get_image(so->output);
+	if (image)
+		return pixman_image_create_bits(pixman_image_get_format(image),
+						pixman_image_get_width(image),
+						pixman_image_get_height(image),
+						pixman_image_get_data(image),
+						pixman_image_get_stride(image));
+
+	return pixman_image_ref(so->cache_image);
+}
+
 static void
 shared_output_update(struct shared_output *so)
 {
 	struct ss_shm_buffer *sb;
+	pixman_region32_t damage;
 	pixman_box32_t *r;
-	int i, nrects;
+	int i, nrects, busy;
 	pixman_transform_t transform;
+	pixman_image_t *image;
 
 	/* Only update if we need to */
 	if (!so->cache_dirty || so->parent.frame_cb)
 		return;
 
-	sb = shared_output_get_shm_buffer(so);
+	sb = shared_output_get_shm_buffer(so, &busy);
 	if (sb == NULL) {
+		/* Wait for the parent to release one instead of growing
+		 * the pool, buffer_release() calls us again. */
+		if (busy) {
+			so->shm.waits++;
+			return;
+		}
+
+		shared_output_destroy(so);
+		return;
+	}
+
+	shared_output_buffer_damage(so, sb, &damage);
+
+	image = shared_output_source_image(so);
+	if (!image) {
+		pixman_region32_fini(&damage);
 		shared_output_destroy(so);
 		return;
 	}
 
 	output_compute_transform(so->output, &transform);
-	pixman_image_set_transform(so->cache_image, &transform);
+	pixman_image_set_transform(image, &transform);
 
-	pixman_image_set_clip_region32(sb->pm_image, &sb->damage);
+	pixman_image_set_clip_region32(sb->pm_image, &damage);
 
 	if (so->output->current_scale == 1) {
-		pixman_image_set_filter(so->cache_image,
-					PIXMAN_FILTER_NEAREST, NULL, 0);
+		pixman_image_set_filter(image, PIXMAN_FILTER_NEAREST, NULL, 0);
 	} else {
-		pixman_image_set_filter(so->cache_image,
-					PIXMAN_FILTER_BILINEAR, NULL, 0);
+		pixman_image_set_filter(image, PIXMAN_FILTER_BILINEAR, NULL, 0);
 	}
 
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 so->cache_image, /* src */
+				 image, /* src */
 				 NULL, /* mask */
 				 sb->pm_image, /* dest */
 				 0, 0, /* src_x, src_y */
@@ -630,10 +779,15 @@ shared_output_update(struct shared_output *so)
 				 so->output->width, /* width */
 				 so->output->height /* height */);
 
-	pixman_image_set_transform(sb->pm_image, NULL);
+	pixman_image_unref(image);
 	pixman_image_set_clip_region32(sb->pm_image, NULL);
 
-	r = pixman_region32_rectangles(&sb->damage, &nrects);
+	so->shm.repaint_area += region_area(&damage);
+	pixman_region32_fini(&damage);
+
+	/* The parent only needs to know what changed since the last
+	 * commit, whatever the buffer needed repairing. */
+	r = pixman_region32_rectangles(&so->shm.damage, &nrects);
 	for (i = 0; i < nrects; ++i)
 		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
 				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
@@ -648,9 +802,12 @@ shared_output_update(struct shared_output *so)
 	wl_callback_destroy(wl_display_sync(so->parent.display));
 	wl_display_flush(so->parent.display);
 
-	/* Clear the buffer damage */
-	pixman_region32_fini(&sb->damage);
-	pixman_region32_init(&sb->damage);
+	so->shm.frames++;
+	so->shm.damage_area += region_area(&so->shm.damage);
+
+	sb->frame = so->shm.frame_count;
+	shared_output_rotate_damage(so);
+	so->cache_dirty = 0;
 }
 
 static void
@@ -763,34 +920,20 @@ struct _wl_fullscreen_shell_mode_feedback_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
-static void
-shared_output_repainted(struct wl_listener *listener, void *data)
+/* Reads the damaged part of the output back into the cache image,
+ * which is (re)allocated to the output's mode first. buffer_damage is
+ * in buffer coordinates and grows to the whole output when the cache
+ * image is new.
+ */
+static int
+shared_output_read_back(struct shared_output *so,
+			pixman_region32_t *buffer_damage)
 {
-	struct shared_output *so =
-		container_of(listener, struct shared_output, frame_listener);
-	pixman_region32_t damage;
-	struct ss_shm_buffer *sb;
 	int32_t x, y, width, height, stride;
 	int i, nrects, do_yflip;
 	pixman_box32_t *r;
 	uint32_t *cache_data;
 
-	/* Damage in output coordinates */
-	pixman_region32_init(&damage);
-	pixman_region32_intersect(&damage, &so->output->region,
-				  &so->output->previous_damage);
-	pixman_region32_translate(&damage, -so->output->x, -so->output->y);
-
-	/* Apply damage to all buffers */
-	wl_list_for_each(sb, &so->shm.buffers, link)
-		pixman_region32_union(&sb->damage, &sb->damage, &damage);
-
-	/* Transform to buffer coordinates */
-	weston_transformed_region(so->output->width, so->output->height,
-				  so->output->transform,
-				  so->output->current_scale,
-				  &damage, &damage);
-
 	width = so->output->current_mode->width;
 	height = so->output->current_mode->height;
 	stride = width;
@@ -805,24 +948,20 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 			pixman_image_create_bits(PIXMAN_a8r8g8b8,
 						 width, height, NULL,
 						 stride);
-		if (!so->cache_image) {
-			shared_output_destroy(so);
-			return;
-		}
+		if (!so->cache_image)
+			return -1;
 
-		pixman_region32_fini(&damage);
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
+		pixman_region32_fini(buffer_damage);
+		pixman_region32_init_rect(buffer_damage, 0, 0, width, height);
 	}
 
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
-		shared_output_destroy(so);
-		return;
-	}
+	if (shared_output_ensure_tmp_data(so, buffer_damage) < 0)
+		return -1;
 
 	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
 	cache_data = pixman_image_get_data(so->cache_image);
-	r = pixman_region32_rectangles(&damage, &nrects);
+	r = pixman_region32_rectangles(buffer_damage, &nrects);
 	for (i = 0; i < nrects; ++i) {
 		x = r[i].x1;
 		y = r[i].y1;
@@ -847,6 +986,60 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		}
 	}
 
+	return 0;
+}
+
+static void
+shared_output_repainted(struct wl_listener *listener, void *data)
+{
+	struct shared_output *so =
+		container_of(listener, struct shared_output, frame_listener);
+	pixman_region32_t damage, buffer_damage;
+	pixman_image_t *image;
+
+	/* Damage in output coordinates */
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &so->output->region,
+				  &so->output->previous_damage);
+	pixman_region32_translate(&damage, -so->output->x, -so->output->y);
+
+	/* Transform to buffer coordinates */
+	pixman_region32_init(&buffer_damage);
+	weston_transformed_region(so->output->width, so->output->height,
+				  so->output->transform,
+				  so->output->current_scale,
+				  &damage, &buffer_damage);
+
+	/* With the pixman renderer the frame is in memory already and
+	 * shared_output_update() copies straight out of it, otherwise
+	 * read the damage back into the cache first. */
+	image = pixman_renderer_output_get_image(so->output);
+	if (!image) {
+		if (shared_output_read_back(so, &buffer_damage) < 0) {
+			pixman_region32_fini(&damage);
+			pixman_region32_fini(&buffer_damage);
+			shared_output_destroy(so);
+			return;
+		}
+		image = so->cache_image;
+	}
+
+	/* Buffer and output coordinates only match without a transform,
+	 * otherwise the whole damage is passed on. Tiles are hashed as
+	 * 32 bit pixels. */
+	if (so->use_tile_diff &&
+	    so->output->transform == WL_OUTPUT_TRANSFORM_NORMAL &&
+	    so->output->current_scale == 1 &&
+	    PIXMAN_FORMAT_BPP(pixman_image_get_format(image)) == 32) {
+		weston_tile_diff_filter(&so->tile_diff, image, &buffer_damage);
+		pixman_region32_intersect(&damage, &damage, &buffer_damage);
+	}
+
+	/* Buffers pick up the damage of the frames they missed when
+	 * they are used again */
+	pixman_region32_union(&so->shm.damage, &so->shm.damage, &damage);
+
+	pixman_region32_fini(&buffer_damage);
 	pixman_region32_fini(&damage);
 
 	so->cache_dirty = 1;
@@ -860,7 +1053,8 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	struct shared_output *so;
 	struct wl_event_loop *loop;
 	struct ss_seat *seat;
-	int epoll_fd;
+	struct weston_config_section *section;
+	int epoll_fd, i;
 
 	so = zalloc(sizeof *so);
 	if (so == NULL)
@@ -868,6 +1062,18 @@ shared_output_create(struct weston_output *output, int parent_fd)
 
 	wl_list_init(&so->seat_list);
 
+	section = weston_config_get_section(output->compositor->config,
+					    "core", NULL, NULL);
+	weston_config_section_get_bool(section, "tile-diff",
+				       &so->use_tile_diff, 0);
+	weston_tile_diff_init(&so->tile_diff, 64);
+	weston_config_section_get_int(section, "screen-share-buffers",
+				      &so->shm.max_buffers, 3);
+	if (so->shm.max_buffers < 2)
+		so->shm.max_buffers = 2;
+	if (so->shm.max_buffers > SS_MAX_BUFFERS)
+		so->shm.max_buffers = SS_MAX_BUFFERS;
+
 	so->parent.display = wl_display_connect_to_fd(parent_fd);
 	if (!so->parent.display)
 		goto err_alloc;
@@ -934,6 +1140,10 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	pixman_region32_init(&so->shm.damage);
+	for (i = 0; i < SS_MAX_BUFFERS - 1; i++)
+		pixman_region32_init(&so->shm.history[i]);
+	so->shm.frame_count = 1;
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -961,13 +1171,26 @@ static void
 shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
+	int i;
+
+	weston_log("screen share stopped, %u frames, at most %d buffers "
+		   "of %dK, waited %u times for a release, repainted "
+		   "%llu pixels for %llu damaged\n",
+		   so->shm.frames, so->shm.peak_count,
+		   so->shm.width * so->shm.height * 4 / 1024,
+		   so->shm.waits,
+		   (unsigned long long) so->shm.repaint_area,
+		   (unsigned long long) so->shm.damage_area);
 
 	so->output->disable_planes--;
 
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
 		ss_shm_buffer_destroy(buffer);
-	wl_list_for_each_safe(buffer, bnext, &so->shm.free_buffers, link)
+	wl_list_for_each_safe(buffer, bnext, &so->shm.free_buffers, free_link)
 		ss_shm_buffer_destroy(buffer);
+	pixman_region32_fini(&so->shm.damage);
+	for (i = 0; i < SS_MAX_BUFFERS - 1; i++)
+		pixman_region32_fini(&so->shm.history[i]);
 
 	wl_display_disconnect(so->parent.display);
 	wl_event_source_remove(so->event_source);
@@ -975,8 +1198,10 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_remove(&so->output_destroyed.link);
 	wl_list_remove(&so->frame_listener.link);
 
-	pixman_image_unref(so->cache_image);
+	if (so->cache_image)
+		pixman_image_unref(so->cache_image);
 	free(so->tmp_data);
+	weston_tile_diff_release(&so->tile_diff);
 
 	free(so);
 }
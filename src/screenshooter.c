@@ -29,11 +29,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <pthread.h>
 
 #include "compositor.h"
 #include "screenshooter-server-protocol.h"
 
 #include "../wcap/wcap-decode.h"
+#include "../wcap/wcap-rle.h"
 
 struct screenshooter {
 	struct weston_compositor *ec;
@@ -294,140 +296,90 @@ screenshooter_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 					screenshooter_exe, screenshooter_sigchld);
 }
 
+/* Frames captured but not yet written out. If the encoder falls behind
+ * this many frames, new frames are dropped and their damage is carried
+ * over to the next frame that makes it into the queue. */
+#define RECORDER_QUEUE_LENGTH 4
+
+struct recorder_frame {
+	struct wl_list link;
+	uint32_t msecs;
+	int nrects;
+	pixman_box32_t *rects;
+	uint32_t *pixels;
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
+	uint32_t *frame;
 	uint32_t *tmpbuf;
 	uint32_t total;
 	int fd;
+	int stride, height, do_yflip;
 	struct wl_listener frame_listener;
-	int count, destroying;
+	int count, dropped, destroying;
+	pixman_region32_t pending_damage;
+
+	pthread_t worker_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	struct wl_list queue;
+	int queue_length;
+	int worker_done;
 };
 
-static uint32_t *
-output_run(uint32_t *p, uint32_t delta, int run)
-{
-	int i;
-
-	while (run > 0) {
-		if (run <= 0xe0) {
-			*p++ = delta | ((run - 1) << 24);
-			break;
-		}
-
-		i = 24 - __builtin_clz(run);
-		*p++ = delta | ((i + 0xe0) << 24);
-		run -= 1 << (7 + i);
-	}
-
-	return p;
-}
-
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+static void
+recorder_frame_destroy(struct recorder_frame *frame)
 {
-	unsigned char dr, dg, db;
-
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
-
-	return (dr << 16) | (dg << 8) | (db << 0);
+	free(frame->rects);
+	free(frame->pixels);
+	free(frame);
 }
 
+/* Runs on the worker thread, recorder->frame and recorder->tmpbuf
+ * belong to it. */
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
-
-static void
-weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+recorder_write_frame(struct weston_recorder *recorder,
+		     struct recorder_frame *frame)
 {
-	struct weston_recorder *recorder =
-		container_of(listener, struct weston_recorder, frame_listener);
-	struct weston_output *output = data;
-	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
-	pixman_box32_t *r;
-	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
+	pixman_box32_t *r = frame->rects;
+	int i, j, width, height, y_orig;
+	uint32_t *d, *s, *p;
+	uint32_t *outbuf = recorder->tmpbuf;
+	struct wcap_rle_state state;
 	struct {
 		uint32_t msecs;
 		uint32_t nrects;
 	} header;
 	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
-
-	pixman_region32_init(&damage);
-	pixman_region32_init(&transformed_damage);
-	pixman_region32_intersect(&damage, &output->region,
-				  &output->previous_damage);
-	pixman_region32_translate(&damage, -output->x, -output->y);
-	weston_transformed_region(output->width, output->height,
-				 output->transform, output->current_scale,
-				 &damage, &transformed_damage);
-	pixman_region32_fini(&damage);
-
-	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
-	}
 
-	header.msecs = msecs;
-	header.nrects = n;
+	header.msecs = frame->msecs;
+	header.nrects = frame->nrects;
 	v[0].iov_base = &header;
 	v[0].iov_len = sizeof header;
 	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
+	v[1].iov_len = frame->nrects * sizeof *r;
 	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
 
-	for (i = 0; i < n; i++) {
+	s = frame->pixels;
+	for (i = 0; i < frame->nrects; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
-		else
-			y_orig = r[i].y1;
-
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		s = recorder->rect;
 		p = outbuf;
-		run = prev = 0; /* quiet gcc */
+		memset(&state, 0, sizeof state);
 		for (j = 0; j < height; j++) {
-			if (do_yflip)
+			if (recorder->do_yflip)
 				y_orig = r[i].y2 - j - 1;
 			else
 				y_orig = r[i].y1 + j;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
+			d = recorder->frame + recorder->stride * y_orig + r[i].x1;
+
+			p = wcap_rle_encode_span(p, &state, d, s, width);
+			s += width;
 		}
 
-		p = output_run(p, prev, run);
+		p = wcap_rle_finish(p, &state);
 
 		recorder->total += write(recorder->fd,
 					 outbuf, (p - outbuf) * 4);
@@ -441,10 +393,161 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 			recorder->total / 1024 / 1024);
 #endif
 	}
+}
 
-	pixman_region32_fini(&transformed_damage);
+static void *
+recorder_worker_thread(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+
+	for (;;) {
+		while (wl_list_empty(&recorder->queue) &&
+		       !recorder->worker_done)
+			pthread_cond_wait(&recorder->queue_cond,
+					  &recorder->mutex);
+
+		/* Drain the queue before exiting so the file is complete. */
+		if (wl_list_empty(&recorder->queue))
+			break;
+
+		frame = container_of(recorder->queue.next,
+				     struct recorder_frame, link);
+		wl_list_remove(&frame->link);
+		pthread_mutex_unlock(&recorder->mutex);
+
+		recorder_write_frame(recorder, frame);
+		recorder_frame_destroy(frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->queue_length--;
+	}
+
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
+}
+
+static struct recorder_frame *
+recorder_capture_frame(struct weston_recorder *recorder,
+		       pixman_region32_t *damage, uint32_t msecs)
+{
+	struct weston_output *output = recorder->output;
+	struct weston_compositor *compositor = output->compositor;
+	struct recorder_frame *frame;
+	pixman_box32_t *r;
+	uint32_t *pixels;
+	int i, n, width, height, y_orig, size = 0;
+
+	r = pixman_region32_rectangles(damage, &n);
+	for (i = 0; i < n; i++)
+		size += (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	frame = zalloc(sizeof *frame);
+	if (frame == NULL)
+		return NULL;
+
+	frame->msecs = msecs;
+	frame->nrects = n;
+	frame->rects = malloc(n * sizeof *r);
+	frame->pixels = malloc(size * 4);
+	if (frame->rects == NULL || frame->pixels == NULL) {
+		recorder_frame_destroy(frame);
+		return NULL;
+	}
+
+	memcpy(frame->rects, r, n * sizeof *r);
+
+	pixels = frame->pixels;
+	for (i = 0; i < n; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		if (recorder->do_yflip)
+			y_orig = recorder->height - r[i].y2;
+		else
+			y_orig = r[i].y1;
+
+		compositor->renderer->read_pixels(output,
+				compositor->read_format, pixels,
+				r[i].x1, y_orig, width, height);
+		pixels += width * height;
+	}
+
+	return frame;
+}
+
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+/* Only the pixels are read back here, in the frame signal. Encoding and
+ * writing the file is left to the worker thread, and when it can't keep
+ * up we drop frames rather than hold up the repaint loop. */
+static void
+weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct weston_recorder *recorder =
+		container_of(listener, struct weston_recorder, frame_listener);
+	struct weston_output *output = data;
+	struct recorder_frame *frame;
+	pixman_region32_t damage, transformed_damage;
+	int queue_full;
+
+	pixman_region32_init(&damage);
+	pixman_region32_init(&transformed_damage);
+	pixman_region32_intersect(&damage, &output->region,
+				  &output->previous_damage);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+	weston_transformed_region(output->width, output->height,
+				 output->transform, output->current_scale,
+				 &damage, &transformed_damage);
+	pixman_region32_fini(&damage);
+
+	/* Whatever was damaged while frames were being dropped has to go
+	 * out with this one, or the worker's copy of the frame goes stale. */
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->pending_damage);
+
+	if (!pixman_region32_not_empty(&transformed_damage))
+		goto out;
+
+	pthread_mutex_lock(&recorder->mutex);
+	queue_full = recorder->queue_length >= RECORDER_QUEUE_LENGTH;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	/* The last frame is queued regardless, the worker drains the queue
+	 * before it exits anyway. */
+	if (queue_full && !recorder->destroying) {
+		pixman_region32_copy(&recorder->pending_damage,
+				     &transformed_damage);
+		recorder->dropped++;
+		goto out;
+	}
+
+	frame = recorder_capture_frame(recorder, &transformed_damage,
+				       output->frame_time);
+	if (frame == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		pixman_region32_copy(&recorder->pending_damage,
+				     &transformed_damage);
+		recorder->dropped++;
+		goto out;
+	}
+
+	pixman_region32_clear(&recorder->pending_damage);
 	recorder->count++;
 
+	pthread_mutex_lock(&recorder->mutex);
+	wl_list_insert(recorder->queue.prev, &frame->link);
+	recorder->queue_length++;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+out:
+	pixman_region32_fini(&transformed_damage);
+
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
 }
@@ -454,7 +557,7 @@ weston_recorder_free(struct weston_recorder *recorder)
 {
 	if (recorder == NULL)
 		return;
-	free(recorder->rect);
+	pixman_region32_fini(&recorder->pending_damage);
 	free(recorder->tmpbuf);
 	free(recorder->frame);
 	free(recorder);
@@ -465,38 +568,34 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
+	int size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
 
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-
-	recorder = malloc(sizeof *recorder);
+	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
 		weston_log("%s: out of memory\n", __func__);
 		return;
 	}
 
-	stride = output->current_mode->width;
-	size = stride * 4 * output->current_mode->height;
+	pixman_region32_init(&recorder->pending_damage);
+	wl_list_init(&recorder->queue);
+	wcap_rle_init();
+
+	recorder->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	recorder->stride = output->current_mode->width;
+	recorder->height = output->current_mode->height;
+	size = recorder->stride * 4 * recorder->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
-	recorder->total = 0;
-	recorder->count = 0;
-	recorder->destroying = 0;
+	recorder->tmpbuf = malloc(size);
 	recorder->output = output;
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if ((recorder->frame == NULL) || (recorder->tmpbuf == NULL)) {
 		weston_log("%s: out of memory\n", __func__);
 		weston_recorder_free(recorder);
 		return;
 	}
 
-	if (do_yflip)
-		recorder->tmpbuf = NULL;
-	else
-		recorder->tmpbuf = malloc(size);
-
 	header.magic = WCAP_HEADER_MAGIC;
 
 	switch (compositor->read_format) {
@@ -526,6 +625,18 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	header.height = output->current_mode->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
 
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->queue_cond, NULL);
+	if (pthread_create(&recorder->worker_thread, NULL,
+			   recorder_worker_thread, recorder) != 0) {
+		weston_log("failed to start recorder thread\n");
+		pthread_mutex_destroy(&recorder->mutex);
+		pthread_cond_destroy(&recorder->queue_cond);
+		close(recorder->fd);
+		weston_recorder_free(recorder);
+		return;
+	}
+
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
 	output->disable_planes++;
@@ -536,6 +647,21 @@ static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->worker_done = 1;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	pthread_join(recorder->worker_thread, NULL);
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->queue_cond);
+
+	weston_log("recorder stopped, total file size %dM, "
+		   "%d frames, %d dropped\n",
+		   recorder->total / (1024 * 1024), recorder->count,
+		   recorder->dropped);
+
 	close(recorder->fd);
 	recorder->output->disable_planes--;
 	weston_recorder_free(recorder);
@@ -562,9 +688,7 @@ recorder_binding(struct weston_seat *seat, uint32_t time, uint32_t key, void *da
 		recorder = container_of(listener, struct weston_recorder,
 					frame_listener);
 
-		weston_log(
-			"stopping recorder, total file size %dM, %d frames\n",
-			recorder->total / (1024 * 1024), recorder->count);
+		weston_log("stopping recorder\n");
 
 		recorder->destroying = 1;
 		weston_output_schedule_repaint(recorder->output);
@@ -22,6 +22,11 @@
 
 #include "config.h"
 
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
 #include "compositor.h"
 
 WL_EXPORT void
@@ -40,6 +45,180 @@ weston_view_schedule_repaint(struct weston_view *view)
 {
 }
 
+/* Offline animation benchmark: runs count view animations at once on
+ * a made up output, restarting each one as it finishes, and steps them
+ * with a 60 Hz animation clock. Reports the CPU time per frame and a
+ * checksum of the animated state, which must not change from run to
+ * run.
+ */
+
+#define BENCH_FRAMES 600
+#define BENCH_FRAME_MSECS 16
+
+struct bench {
+	struct weston_compositor compositor;
+	struct weston_output output;
+	struct weston_surface *surfaces;
+	struct weston_view *views;
+	uint32_t msecs;
+	int started;
+	int stopping;
+};
+
+static uint32_t
+bench_clock(void *data)
+{
+	struct bench *bench = data;
+
+	return bench->msecs;
+}
+
+static void
+bench_start(struct bench *bench, struct weston_view *view);
+
+static void
+bench_done(struct weston_view_animation *animation, void *data)
+{
+	struct weston_view *view = data;
+	struct bench *bench = container_of(view->output, struct bench, output);
+
+	if (!bench->stopping)
+		bench_start(bench, view);
+}
+
+static void
+bench_start(struct bench *bench, struct weston_view *view)
+{
+	struct weston_view_animation *animation = NULL;
+
+	switch (bench->started++ % 4) {
+	case 0:
+		animation = weston_zoom_run(view, 0.8, 1.0,
+					    bench_done, view);
+		break;
+	case 1:
+		animation = weston_fade_run(view, 0.0, 1.0, 400.0,
+					    bench_done, view);
+		break;
+	case 2:
+		animation = weston_slide_run(view, -100.0, 0.0,
+					     bench_done, view);
+		break;
+	case 3:
+		animation = weston_move_scale_run(view, 50, 30, 1.0, 0.9, 0,
+						  bench_done, view);
+		break;
+	}
+
+	if (!animation) {
+		fprintf(stderr, "failed to start animation\n");
+		exit(1);
+	}
+}
+
+static double
+cpu_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+run_bench(int count)
+{
+	struct bench bench;
+	struct weston_animation *animation, *next;
+	struct weston_transform *transform;
+	struct weston_view *view;
+	double t, frame_time, total = 0, max = 0, checksum = 0;
+	uint32_t msecs;
+	int i, j, f;
+
+	if (count < 1)
+		count = 1;
+
+	memset(&bench, 0, sizeof bench);
+	bench.output.compositor = &bench.compositor;
+	wl_list_init(&bench.output.animation_list);
+	weston_compositor_set_animation_clock(&bench.compositor,
+					      bench_clock, &bench);
+
+	bench.surfaces = calloc(count, sizeof *bench.surfaces);
+	bench.views = calloc(count, sizeof *bench.views);
+	if (!bench.surfaces || !bench.views)
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		bench.surfaces[i].width = 200 + i % 300;
+		bench.surfaces[i].height = 100 + i % 200;
+
+		view = &bench.views[i];
+		view->surface = &bench.surfaces[i];
+		view->output = &bench.output;
+		view->alpha = 1.0;
+		wl_signal_init(&view->destroy_signal);
+		wl_list_init(&view->geometry.transformation_list);
+
+		bench_start(&bench, view);
+	}
+
+	/* The same steps weston_output_repaint() takes for animations. */
+	for (f = 0; f < BENCH_FRAMES; f++) {
+		bench.msecs += BENCH_FRAME_MSECS;
+
+		t = cpu_time();
+		msecs = weston_compositor_get_animation_time(&bench.compositor);
+		wl_list_for_each_safe(animation, next,
+				      &bench.output.animation_list, link) {
+			animation->frame_counter++;
+			animation->frame(animation, &bench.output, msecs);
+		}
+		frame_time = cpu_time() - t;
+
+		total += frame_time;
+		if (frame_time > max)
+			max = frame_time;
+	}
+
+	for (i = 0; i < count; i++) {
+		view = &bench.views[i];
+		checksum += view->alpha;
+		wl_list_for_each(transform, &view->geometry.transformation_list,
+				 link)
+			for (j = 0; j < 16; j++)
+				checksum += transform->matrix.d[j];
+	}
+
+	printf("%d animations, %d frames, %d started\n",
+	       count, BENCH_FRAMES, bench.started);
+	printf("cpu: %8.2f us/frame average, %8.2f us/frame max\n",
+	       total * 1e6 / BENCH_FRAMES, max * 1e6);
+	printf("checksum: %.6f\n", checksum);
+
+	/* Destroying the views finishes their animations for good. */
+	bench.stopping = 1;
+	for (i = 0; i < count; i++)
+		wl_signal_emit(&bench.views[i].destroy_signal,
+			       &bench.views[i]);
+
+	free(bench.views);
+	free(bench.surfaces);
+
+	return 0;
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [--bench [count]]\n"
+		"Prints the trajectory of a zoom spring, or with --bench\n"
+		"runs count view animations at once (default 100) and\n"
+		"reports the CPU time spent per frame.\n", name);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -51,6 +230,15 @@ main(int argc, char *argv[])
 	struct weston_spring spring;
 	uint32_t time = 0;
 
+	if (argc > 1) {
+		if (strcmp(argv[1], "--bench") != 0) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		return run_bench(argc > 2 ? atoi(argv[2]) : 100);
+	}
+
 	weston_spring_init(&spring, k, current, target);
 	spring.friction = friction;
 	spring.previous = 0.48;
@@ -0,0 +1,198 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compositor.h"
+
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+static uint64_t
+hash_row(uint64_t h, const uint32_t *p, int n)
+{
+	uint64_t v;
+	int i;
+
+	for (i = 0; i + 1 < n; i += 2) {
+		memcpy(&v, p + i, sizeof v);
+		h = (h ^ v) * HASH_MULTIPLIER;
+		h ^= h >> 29;
+	}
+
+	if (i < n) {
+		h = (h ^ p[i]) * HASH_MULTIPLIER;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+static uint64_t
+hash_tile(pixman_image_t *image, pixman_box32_t *box)
+{
+	uint32_t *data = pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image) / 4;
+	uint64_t h = 0;
+	int y;
+
+	for (y = box->y1; y < box->y2; y++)
+		h = hash_row(h, data + y * stride + box->x1,
+			     box->x2 - box->x1);
+
+	return h;
+}
+
+static void
+tile_box(struct weston_tile_diff *td, int column, int row,
+	 pixman_box32_t *box)
+{
+	box->x1 = column * td->tile_size;
+	box->y1 = row * td->tile_size;
+	box->x2 = box->x1 + td->tile_size;
+	box->y2 = box->y1 + td->tile_size;
+	if (box->x2 > td->width)
+		box->x2 = td->width;
+	if (box->y2 > td->height)
+		box->y2 = td->height;
+}
+
+/* Hashes every tile of image and starts over, damage is left alone. */
+static void
+tile_diff_reset(struct weston_tile_diff *td, pixman_image_t *image)
+{
+	pixman_box32_t box;
+	int i, j;
+
+	free(td->hashes);
+
+	td->width = pixman_image_get_width(image);
+	td->height = pixman_image_get_height(image);
+	td->columns = (td->width + td->tile_size - 1) / td->tile_size;
+	td->rows = (td->height + td->tile_size - 1) / td->tile_size;
+	td->hashes = malloc(td->columns * td->rows * sizeof *td->hashes);
+	if (!td->hashes)
+		return;
+
+	for (j = 0; j < td->rows; j++) {
+		for (i = 0; i < td->columns; i++) {
+			tile_box(td, i, j, &box);
+			td->hashes[j * td->columns + i] = hash_tile(image, &box);
+		}
+	}
+}
+
+WL_EXPORT void
+weston_tile_diff_init(struct weston_tile_diff *td, int tile_size)
+{
+	memset(td, 0, sizeof *td);
+	td->tile_size = tile_size;
+}
+
+WL_EXPORT void
+weston_tile_diff_release(struct weston_tile_diff *td)
+{
+	if (td->damage_bytes)
+		weston_log("tile diff: %llu of %llu damaged bytes changed, "
+			   "%llu saved\n",
+			   (unsigned long long) td->changed_bytes,
+			   (unsigned long long) td->damage_bytes,
+			   (unsigned long long)
+			   (td->damage_bytes - td->changed_bytes));
+
+	free(td->hashes);
+	td->hashes = NULL;
+}
+
+static uint64_t
+region_bytes(pixman_region32_t *region)
+{
+	pixman_box32_t *r;
+	uint64_t area = 0;
+	int i, n;
+
+	r = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	return area * 4;
+}
+
+/* Called with the image as it is after the repaint and the damage of
+ * that repaint, in image coordinates. Cuts the damage down to the tiles
+ * that don't hash the same as the last time. Tiles outside the damage
+ * can't have changed, so only the damaged ones are hashed. */
+WL_EXPORT void
+weston_tile_diff_filter(struct weston_tile_diff *td, pixman_image_t *image,
+			pixman_region32_t *damage)
+{
+	pixman_region32_t changed;
+	pixman_box32_t *extents, box;
+	uint64_t h, *hash;
+	int i, j, x1, y1, x2, y2;
+
+	td->damage_bytes += region_bytes(damage);
+
+	if (!td->hashes ||
+	    td->width != pixman_image_get_width(image) ||
+	    td->height != pixman_image_get_height(image)) {
+		tile_diff_reset(td, image);
+		td->changed_bytes += region_bytes(damage);
+		return;
+	}
+
+	extents = pixman_region32_extents(damage);
+	x1 = extents->x1 > 0 ? extents->x1 / td->tile_size : 0;
+	y1 = extents->y1 > 0 ? extents->y1 / td->tile_size : 0;
+	x2 = (MIN(extents->x2, td->width) + td->tile_size - 1) / td->tile_size;
+	y2 = (MIN(extents->y2, td->height) + td->tile_size - 1) / td->tile_size;
+
+	pixman_region32_init(&changed);
+
+	for (j = y1; j < y2; j++) {
+		for (i = x1; i < x2; i++) {
+			tile_box(td, i, j, &box);
+			if (pixman_region32_contains_rectangle(damage, &box) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			h = hash_tile(image, &box);
+			hash = &td->hashes[j * td->columns + i];
+			if (h == *hash)
+				continue;
+
+			*hash = h;
+			pixman_region32_union_rect(&changed, &changed,
+						   box.x1, box.y1,
+						   box.x2 - box.x1,
+						   box.y2 - box.y1);
+		}
+	}
+
+	pixman_region32_intersect(damage, damage, &changed);
+	pixman_region32_fini(&changed);
+
+	td->changed_bytes += region_bytes(damage);
+}
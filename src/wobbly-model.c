@@ -0,0 +1,428 @@
+/*
+ * Copyright © 2005 Novell, Inc.
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of
+ * Novell, Inc. not be used in advertising or publicity pertaining to
+ * distribution of the software without specific, written prior permission.
+ * Novell, Inc. makes no representations about the suitability of this
+ * software for any purpose. It is provided "as is" without express or
+ * implied warranty.
+ *
+ * NOVELL, INC. DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL NOVELL, INC. BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Author: David Reveman <davidr@novell.com>
+ *         Scott Moreau  <oreaus@gmail.com>
+ */
+
+/*
+ * Spring model implemented by Kristian Hogsberg.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "wobbly-model.h"
+
+#define MASS 20.0f
+
+/* Kernels are written with GCC vector extensions, which compile to SSE
+ * or NEON where available and to scalar code elsewhere. */
+typedef float v4sf __attribute__ ((vector_size (16)));
+typedef int32_t v4si __attribute__ ((vector_size (16)));
+
+static inline v4sf
+load(const float *p)
+{
+	v4sf v;
+
+	memcpy(&v, p, sizeof v);
+
+	return v;
+}
+
+static inline void
+store(float *p, v4sf v)
+{
+	memcpy(p, &v, sizeof v);
+}
+
+static inline v4sf
+splat(float f)
+{
+	return (v4sf) { f, f, f, f };
+}
+
+static inline v4sf
+vabs(v4sf v)
+{
+	const v4si mask = { 0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff };
+
+	return (v4sf) ((v4si) v & mask);
+}
+
+static inline v4sf
+vmin(v4sf a, v4sf b)
+{
+	v4si less = a < b;
+
+	return (v4sf) (((v4si) a & less) | ((v4si) b & ~less));
+}
+
+static inline v4sf
+vmax(v4sf a, v4sf b)
+{
+	v4si less = a < b;
+
+	return (v4sf) (((v4si) b & less) | ((v4si) a & ~less));
+}
+
+static inline float
+hsum(v4sf v)
+{
+	return v[0] + v[1] + v[2] + v[3];
+}
+
+void
+modelSetAnchor(Model *model, int object)
+{
+	if (model->anchorObject >= 0)
+		model->mobile[model->anchorObject] = 1.0f;
+
+	model->anchorObject = object;
+
+	if (object >= 0) {
+		model->mobile[object] = 0.0f;
+		model->velocityX[object] = 0.0f;
+		model->velocityY[object] = 0.0f;
+	}
+}
+
+static void
+modelSetMiddleAnchor(Model *model,
+			  int   x,
+			  int   y,
+			  int   width,
+			  int   height)
+{
+	float gx, gy;
+	int object;
+
+	gx = ((GRID_WIDTH  - 1) / 2 * width)  / (float) (GRID_WIDTH  - 1);
+	gy = ((GRID_HEIGHT - 1) / 2 * height) / (float) (GRID_HEIGHT - 1);
+
+	object = GRID_WIDTH * ((GRID_HEIGHT - 1) / 2) + (GRID_WIDTH - 1) / 2;
+	modelSetAnchor(model, object);
+
+	model->positionX[object] = x + gx;
+	model->positionY[object] = y + gy;
+}
+
+void
+modelInitObjects(Model *model,
+		  int	x,
+		  int   y,
+		  int	width,
+		  int	height)
+{
+	int gridX, gridY, i = 0;
+	float gw, gh;
+
+	gw = GRID_WIDTH  - 1;
+	gh = GRID_HEIGHT - 1;
+
+	for (gridY = 0; gridY < GRID_HEIGHT; gridY++)
+	{
+		for (gridX = 0; gridX < GRID_WIDTH; gridX++)
+		{
+			model->positionX[i] = x + (gridX * width) / gw;
+			model->positionY[i] = y + (gridY * height) / gh;
+			model->velocityX[i] = 0.0f;
+			model->velocityY[i] = 0.0f;
+			model->mobile[i] = 1.0f;
+			i++;
+		}
+	}
+
+	model->anchorObject = -1;
+	modelSetMiddleAnchor(model, x, y, width, height);
+}
+
+void
+modelInitSprings(Model *model,
+		  int   x,
+		  int   y,
+		  int   width,
+		  int   height)
+{
+	model->springX = ((float) width) / (GRID_WIDTH  - 1);
+	model->springY = ((float) height) / (GRID_HEIGHT - 1);
+}
+
+void
+modelCalcBounds(Model *model)
+{
+	v4sf minX, minY, maxX, maxY, x, y;
+	int i;
+
+	minX = maxX = load(model->positionX);
+	minY = maxY = load(model->positionY);
+
+	for (i = GRID_WIDTH; i < MODEL_OBJECTS; i += GRID_WIDTH)
+	{
+		x = load(model->positionX + i);
+		y = load(model->positionY + i);
+		minX = vmin(minX, x);
+		minY = vmin(minY, y);
+		maxX = vmax(maxX, x);
+		maxY = vmax(maxY, y);
+	}
+
+	model->topLeft.x = fminf(fminf(minX[0], minX[1]),
+				 fminf(minX[2], minX[3]));
+	model->topLeft.y = fminf(fminf(minY[0], minY[1]),
+				 fminf(minY[2], minY[3]));
+	model->bottomRight.x = fmaxf(fmaxf(maxX[0], maxX[1]),
+				     fmaxf(maxX[2], maxX[3]));
+	model->bottomRight.y = fmaxf(fmaxf(maxY[0], maxY[1]),
+				     fmaxf(maxY[2], maxY[3]));
+}
+
+Model *
+createModel(int	  x,
+		 int	  y,
+		 int	  width,
+		 int	  height)
+{
+	Model *model;
+
+	if (posix_memalign((void **) &model, 16, sizeof *model) != 0)
+		return NULL;
+
+	memset(model, 0, sizeof *model);
+	model->steps = 0;
+
+	modelInitObjects(model, x, y, width, height);
+	modelInitSprings(model, x, y, width, height);
+
+	modelCalcBounds(model);
+
+	return model;
+}
+
+#if defined(__clang__)
+#define ROTATE_RIGHT(v) __builtin_shufflevector(v, v, 3, 0, 1, 2)
+#else
+#define ROTATE_RIGHT(v) __builtin_shuffle(v, (v4si) { 3, 0, 1, 2 })
+#endif
+
+/* One fixed step of the whole grid, with every row of it held in one
+ * vector. A spring pulls both its ends towards its rest length with
+ * half of k times the stretch. The springs across pair a row with
+ * itself shifted by one object, the last lane masked off, and the
+ * springs down pair a row with the next one. The anchor has mobile set
+ * to 0, which clears its force and velocity without a branch.
+ */
+static void
+modelStepOnce(Model *model, float friction, float k,
+	      v4sf *velocitySum, v4sf *forceSum)
+{
+	const v4sf last = { 1.0f, 1.0f, 1.0f, 0.0f };
+	const v4sf half_k = splat(0.5f * k);
+	const v4sf spring_x = splat(model->springX);
+	const v4sf spring_y = splat(model->springY);
+	const v4sf fr = splat(friction);
+	const v4sf mass = splat(MASS);
+	v4sf px[GRID_HEIGHT], py[GRID_HEIGHT];
+	v4sf fx[GRID_HEIGHT], fy[GRID_HEIGHT];
+	v4sf dx, dy, vx, vy, m;
+	int r, i;
+
+	for (r = 0, i = 0; r < GRID_HEIGHT; r++, i += GRID_WIDTH) {
+		px[r] = load(model->positionX + i);
+		py[r] = load(model->positionY + i);
+
+		dx = (load(model->positionX + i + 1) - px[r] - spring_x) *
+			last;
+		dy = (load(model->positionY + i + 1) - py[r]) * last;
+		fx[r] = half_k * (dx - ROTATE_RIGHT(dx));
+		fy[r] = half_k * (dy - ROTATE_RIGHT(dy));
+	}
+
+	for (r = 1; r < GRID_HEIGHT; r++) {
+		dx = half_k * (px[r] - px[r - 1]);
+		dy = half_k * (py[r] - py[r - 1] - spring_y);
+		fx[r - 1] += dx;
+		fy[r - 1] += dy;
+		fx[r] -= dx;
+		fy[r] -= dy;
+	}
+
+	for (r = 0, i = 0; r < GRID_HEIGHT; r++, i += GRID_WIDTH) {
+		m = load(model->mobile + i);
+		vx = load(model->velocityX + i);
+		vy = load(model->velocityY + i);
+
+		fx[r] = (fx[r] - fr * vx) * m;
+		fy[r] = (fy[r] - fr * vy) * m;
+
+		vx = (vx + fx[r] / mass) * m;
+		vy = (vy + fy[r] / mass) * m;
+
+		store(model->positionX + i, px[r] + vx);
+		store(model->positionY + i, py[r] + vy);
+		store(model->velocityX + i, vx);
+		store(model->velocityY + i, vy);
+
+		*forceSum += vabs(fx[r]) + vabs(fy[r]);
+		*velocitySum += vabs(vx) + vabs(vy);
+	}
+}
+
+int
+modelStep(Model	  *model,
+	   float	  friction,
+	   float	  k,
+	   float	  time)
+{
+	v4sf velocitySum = splat(0.0f), forceSum = splat(0.0f);
+	int   j, steps, wobbly = 0;
+
+	model->steps += time / 15.0f;
+	steps = floor(model->steps);
+	model->steps -= steps;
+
+	if (!steps)
+		return 1;
+
+	for (j = 0; j < steps; j++)
+		modelStepOnce(model, friction, k, &velocitySum, &forceSum);
+
+	modelCalcBounds(model);
+
+	if (hsum(velocitySum) > 0.3f)
+		wobbly |= WobblyVelocity;
+
+	if (hsum(forceSum) > 15.0f)
+		wobbly |= WobblyForce;
+
+	return wobbly;
+}
+
+/* Makes object the anchor and kicks its neighbours, through the
+ * springs joining them, so the window starts to wobble. */
+void
+modelGrab(Model *model, int object)
+{
+	int gridX = object % GRID_WIDTH, gridY = object / GRID_WIDTH;
+
+	modelSetAnchor(model, object);
+
+	if (gridX < GRID_WIDTH - 1)
+		model->velocityX[object + 1] -= model->springX * 0.05f;
+	if (gridY < GRID_HEIGHT - 1)
+		model->velocityY[object + GRID_WIDTH] -= model->springY * 0.05f;
+	if (gridX > 0)
+		model->velocityX[object - 1] += model->springX * 0.05f;
+	if (gridY > 0)
+		model->velocityY[object - GRID_WIDTH] += model->springY * 0.05f;
+}
+
+int
+modelFindNearestObject(Model *model,
+			float x,
+			float y)
+{
+	float dx, dy, distance, minDistance = 0.0f;
+	int i, object = 0;
+
+	for (i = 0; i < MODEL_OBJECTS; i++)
+	{
+		dx = model->positionX[i] - x;
+		dy = model->positionY[i] - y;
+		distance = dx * dx + dy * dy;
+		if (i == 0 || distance < minDistance)
+		{
+			minDistance = distance;
+			object = i;
+		}
+	}
+
+	return object;
+}
+
+/* Fills basis[i] with the cubic Bernstein polynomials at i / cells,
+ * for i from 0 to cells. */
+void
+bezierBasisInit(float (*basis)[4], int cells)
+{
+	float u;
+	int i;
+
+	for (i = 0; i <= cells; i++) {
+		u = (float) i / cells;
+		basis[i][0] = (1 - u) * (1 - u) * (1 - u);
+		basis[i][1] = 3 * u * (1 - u) * (1 - u);
+		basis[i][2] = 3 * u * u * (1 - u);
+		basis[i][3] = u * u * u;
+	}
+}
+
+void
+bezierPatchEvaluate(Model *model, const float *basisU, const float *basisV,
+		    float *patchX, float *patchY)
+{
+	v4sf x = splat(0.0f), y = splat(0.0f), u = load(basisU);
+	int j;
+
+	for (j = 0; j < GRID_HEIGHT; j++) {
+		x += splat(basisV[j]) * load(model->positionX + j * GRID_WIDTH);
+		y += splat(basisV[j]) * load(model->positionY + j * GRID_WIDTH);
+	}
+
+	*patchX = hsum(x * u);
+	*patchY = hsum(y * u);
+}
+
+/* Evaluates the patch on a (cells + 1)^2 vertex grid, writing the
+ * position of each vertex to v, row by row, stride floats apart. The
+ * rows of the control grid are blended once per vertex row.
+ */
+void
+bezierPatchEvaluateGrid(Model *model, const float (*basis)[4], int cells,
+			float *v, int stride)
+{
+	v4sf rowX, rowY, u;
+	int x, y, j;
+
+	for (y = 0; y <= cells; y++) {
+		rowX = rowY = splat(0.0f);
+		for (j = 0; j < GRID_HEIGHT; j++) {
+			rowX += splat(basis[y][j]) *
+				load(model->positionX + j * GRID_WIDTH);
+			rowY += splat(basis[y][j]) *
+				load(model->positionY + j * GRID_WIDTH);
+		}
+
+		for (x = 0; x <= cells; x++) {
+			u = load(basis[x]);
+			v[0] = hsum(rowX * u);
+			v[1] = hsum(rowY * u);
+			v += stride;
+		}
+	}
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright © 2005 Novell, Inc.
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of
+ * Novell, Inc. not be used in advertising or publicity pertaining to
+ * distribution of the software without specific, written prior permission.
+ * Novell, Inc. makes no representations about the suitability of this
+ * software for any purpose. It is provided "as is" without express or
+ * implied warranty.
+ *
+ * NOVELL, INC. DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL NOVELL, INC. BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Author: David Reveman <davidr@novell.com>
+ *         Scott Moreau  <oreaus@gmail.com>
+ */
+
+#ifndef _WESTON_WOBBLY_MODEL_H_
+#define _WESTON_WOBBLY_MODEL_H_
+
+/* The solver keeps one grid row per 4 float vector. */
+#define GRID_WIDTH  4
+#define GRID_HEIGHT 4
+
+#define MODEL_OBJECTS (GRID_WIDTH * GRID_HEIGHT)
+
+#define WobblyInitial	(1L << 0)
+#define WobblyForce	(1L << 1)
+#define WobblyVelocity	(1L << 2)
+
+typedef struct _xy_pair {
+	float	x, y;
+} Point, Vector;
+
+/* Grid objects in structure of arrays layout, row major. Neighbours
+ * are joined by springs of rest length springX across and springY
+ * down, so the springs are implied by the grid and need no storage.
+ * Forces only live within a step. The spare row keeps the shifted
+ * loads of the last row in bounds and is always zero.
+ */
+typedef struct _Model {
+	float	positionX[MODEL_OBJECTS + GRID_WIDTH];
+	float	positionY[MODEL_OBJECTS + GRID_WIDTH];
+	float	velocityX[MODEL_OBJECTS];
+	float	velocityY[MODEL_OBJECTS];
+	float	mobile[MODEL_OBJECTS];	/* 0 for the anchor, 1 otherwise */
+	int	anchorObject;		/* -1 if none */
+	float	springX, springY;
+	float	steps;
+	Point	topLeft;
+	Point	bottomRight;
+} __attribute__ ((aligned (16))) Model;
+
+Model *
+createModel(int x, int y, int width, int height);
+
+void
+modelInitObjects(Model *model, int x, int y, int width, int height);
+
+void
+modelInitSprings(Model *model, int x, int y, int width, int height);
+
+void
+modelCalcBounds(Model *model);
+
+int
+modelStep(Model *model, float friction, float k, float time);
+
+void
+modelSetAnchor(Model *model, int object);
+
+void
+modelGrab(Model *model, int object);
+
+int
+modelFindNearestObject(Model *model, float x, float y);
+
+void
+bezierBasisInit(float (*basis)[4], int cells);
+
+void
+bezierPatchEvaluate(Model *model, const float *basisU, const float *basisV,
+		    float *patchX, float *patchY);
+
+void
+bezierPatchEvaluateGrid(Model *model, const float (*basis)[4], int cells,
+			float *v, int stride);
+
+#endif
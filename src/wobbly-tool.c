@@ -0,0 +1,353 @@
+/*
+ * Copyright © 2005 Novell, Inc.
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of
+ * Novell, Inc. not be used in advertising or publicity pertaining to
+ * distribution of the software without specific, written prior permission.
+ * Novell, Inc. makes no representations about the suitability of this
+ * software for any purpose. It is provided "as is" without express or
+ * implied warranty.
+ *
+ * NOVELL, INC. DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL NOVELL, INC. BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Author: David Reveman <davidr@novell.com>
+ *         Scott Moreau  <oreaus@gmail.com>
+ */
+
+/*
+ * Benchmark for the wobbly spring model, in the style of spring-tool.
+ * Wobbles a number of windows (64 by default, or argv[1]) for a second
+ * of 16 ms frames with the model of wobbly-model.c and with the array of
+ * structs model it replaced, kept below as reference. Prints the time
+ * per frame for the solver and the mesh evaluation of both, and how far
+ * their grids drifted apart.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "wobbly-model.h"
+
+#define FRAMES 60
+#define CELLS 8
+#define REF_MASS 20.0f
+#define REF_MAX_SPRINGS (GRID_WIDTH * GRID_HEIGHT * 2)
+
+typedef struct {
+	Vector	force;
+	Point	position;
+	Vector	velocity;
+	float	theta;
+	int	immobile;
+	float	edge[12];	/* unused edge data, as in the old layout */
+} RefObject;
+
+typedef struct {
+	RefObject	*a;
+	RefObject	*b;
+	Vector		offset;
+} RefSpring;
+
+typedef struct {
+	RefObject	objects[MODEL_OBJECTS];
+	RefSpring	springs[REF_MAX_SPRINGS];
+	int		numSprings;
+	RefObject	*anchorObject;
+	float		steps;
+	Point		topLeft;
+	Point		bottomRight;
+} RefModel;
+
+static void
+refInit(RefModel *model, int x, int y, int width, int height)
+{
+	float hpad = (float) width / (GRID_WIDTH - 1);
+	float vpad = (float) height / (GRID_HEIGHT - 1);
+	RefSpring *s;
+	int gx, gy, i = 0;
+
+	memset(model, 0, sizeof *model);
+
+	for (gy = 0; gy < GRID_HEIGHT; gy++) {
+		for (gx = 0; gx < GRID_WIDTH; gx++) {
+			model->objects[i].position.x =
+				x + (gx * width) / (float) (GRID_WIDTH - 1);
+			model->objects[i].position.y =
+				y + (gy * height) / (float) (GRID_HEIGHT - 1);
+			if (gx > 0) {
+				s = &model->springs[model->numSprings++];
+				s->a = &model->objects[i - 1];
+				s->b = &model->objects[i];
+				s->offset.x = hpad;
+				s->offset.y = 0;
+			}
+			if (gy > 0) {
+				s = &model->springs[model->numSprings++];
+				s->a = &model->objects[i - GRID_WIDTH];
+				s->b = &model->objects[i];
+				s->offset.x = 0;
+				s->offset.y = vpad;
+			}
+			i++;
+		}
+	}
+}
+
+static void
+refGrab(RefModel *model, int object)
+{
+	RefSpring *s;
+	int i;
+
+	if (model->anchorObject)
+		model->anchorObject->immobile = 0;
+	model->anchorObject = &model->objects[object];
+	model->anchorObject->immobile = 1;
+
+	for (i = 0; i < model->numSprings; i++) {
+		s = &model->springs[i];
+		if (s->a == model->anchorObject) {
+			s->b->velocity.x -= s->offset.x * 0.05f;
+			s->b->velocity.y -= s->offset.y * 0.05f;
+		} else if (s->b == model->anchorObject) {
+			s->a->velocity.x += s->offset.x * 0.05f;
+			s->a->velocity.y += s->offset.y * 0.05f;
+		}
+	}
+}
+
+static void
+refExertForces(RefSpring *spring, float k)
+{
+	Vector da, a = spring->a->position, b = spring->b->position;
+
+	da.x = 0.5f * (b.x - a.x - spring->offset.x);
+	da.y = 0.5f * (b.y - a.y - spring->offset.y);
+
+	spring->a->force.x += k * da.x;
+	spring->a->force.y += k * da.y;
+	spring->b->force.x -= k * da.x;
+	spring->b->force.y -= k * da.y;
+}
+
+static float
+refStepObject(RefObject *object, float friction, float *force)
+{
+	object->theta += 0.05f;
+
+	if (object->immobile) {
+		object->velocity.x = object->velocity.y = 0.0f;
+		object->force.x = object->force.y = 0.0f;
+		*force = 0.0f;
+		return 0.0f;
+	}
+
+	object->force.x -= friction * object->velocity.x;
+	object->force.y -= friction * object->velocity.y;
+	object->velocity.x += object->force.x / REF_MASS;
+	object->velocity.y += object->force.y / REF_MASS;
+	object->position.x += object->velocity.x;
+	object->position.y += object->velocity.y;
+
+	*force = fabs(object->force.x) + fabs(object->force.y);
+	object->force.x = object->force.y = 0.0f;
+
+	return fabs(object->velocity.x) + fabs(object->velocity.y);
+}
+
+static int
+refStep(RefModel *model, float friction, float k, float time)
+{
+	float velocitySum = 0.0f, force, forceSum = 0.0f;
+	int i, j, steps, wobbly = 0;
+
+	model->steps += time / 15.0f;
+	steps = floor(model->steps);
+	model->steps -= steps;
+
+	for (j = 0; j < steps; j++) {
+		for (i = 0; i < model->numSprings; i++)
+			refExertForces(&model->springs[i], k);
+		for (i = 0; i < MODEL_OBJECTS; i++) {
+			velocitySum += refStepObject(&model->objects[i],
+						     friction, &force);
+			forceSum += force;
+		}
+	}
+
+	/* The bounds, as the old modelCalcBounds() did them. */
+	model->topLeft.x = model->topLeft.y = 32767;
+	model->bottomRight.x = model->bottomRight.y = -32768;
+	for (i = 0; i < MODEL_OBJECTS; i++) {
+		if (model->objects[i].position.x < model->topLeft.x)
+			model->topLeft.x = model->objects[i].position.x;
+		else if (model->objects[i].position.x > model->bottomRight.x)
+			model->bottomRight.x = model->objects[i].position.x;
+		if (model->objects[i].position.y < model->topLeft.y)
+			model->topLeft.y = model->objects[i].position.y;
+		else if (model->objects[i].position.y > model->bottomRight.y)
+			model->bottomRight.y = model->objects[i].position.y;
+	}
+
+	if (velocitySum > 0.3f)
+		wobbly |= WobblyVelocity;
+	if (forceSum > 15.0f)
+		wobbly |= WobblyForce;
+
+	return wobbly;
+}
+
+static void
+refEvaluate(RefModel *model, float u, float v, float *x, float *y)
+{
+	float cu[4], cv[4];
+	int i, j;
+
+	cu[0] = (1 - u) * (1 - u) * (1 - u);
+	cu[1] = 3 * u * (1 - u) * (1 - u);
+	cu[2] = 3 * u * u * (1 - u);
+	cu[3] = u * u * u;
+
+	cv[0] = (1 - v) * (1 - v) * (1 - v);
+	cv[1] = 3 * v * (1 - v) * (1 - v);
+	cv[2] = 3 * v * v * (1 - v);
+	cv[3] = v * v * v;
+
+	*x = *y = 0.0f;
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < 4; j++) {
+			*x += cu[i] * cv[j] *
+				model->objects[j * GRID_WIDTH + i].position.x;
+			*y += cu[i] * cv[j] *
+				model->objects[j * GRID_WIDTH + i].position.y;
+		}
+	}
+}
+
+static void
+refEvaluateGrid(RefModel *model, float *v)
+{
+	int x, y;
+
+	for (y = 0; y <= CELLS; y++) {
+		for (x = 0; x <= CELLS; x++) {
+			refEvaluate(model, (float) x / CELLS, (float) y / CELLS,
+				    v, v + 1);
+			v += 4;
+		}
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const float friction = 2, k = 8;
+	static float basis[CELLS + 1][4];
+	int count = argc > 1 ? atoi(argv[1]) : 64;
+	float mesh[(CELLS + 1) * (CELLS + 1) * 4] = { 0 };
+	float ref_mesh[(CELLS + 1) * (CELLS + 1) * 4] = { 0 };
+	double t, step_time = 0, ref_step_time = 0;
+	double mesh_time = 0, ref_mesh_time = 0;
+	float drift = 0, d;
+	RefModel *ref;
+	Model **models;
+	int i, j, f, grab;
+
+	if (count < 1)
+		count = 1;
+
+	ref = calloc(count, sizeof *ref);
+	models = calloc(count, sizeof *models);
+	if (!ref || !models)
+		return 1;
+
+	bezierBasisInit(basis, CELLS);
+	srand(1);
+
+	for (i = 0; i < count; i++) {
+		models[i] = createModel(i * 10, i * 5, 300 + i % 200,
+					200 + i % 100);
+		if (!models[i])
+			return 1;
+		refInit(&ref[i], i * 10, i * 5, 300 + i % 200, 200 + i % 100);
+
+		/* Grab somewhere and fling the window. */
+		grab = rand() % MODEL_OBJECTS;
+		modelGrab(models[i], grab);
+		refGrab(&ref[i], grab);
+		models[i]->positionX[grab] += 40;
+		models[i]->positionY[grab] -= 25;
+		ref[i].objects[grab].position.x += 40;
+		ref[i].objects[grab].position.y -= 25;
+	}
+
+	for (f = 0; f < FRAMES; f++) {
+		t = now();
+		for (i = 0; i < count; i++)
+			modelStep(models[i], friction, k, 16);
+		step_time += now() - t;
+
+		t = now();
+		for (i = 0; i < count; i++)
+			refStep(&ref[i], friction, k, 16);
+		ref_step_time += now() - t;
+
+		t = now();
+		for (i = 0; i < count; i++)
+			bezierPatchEvaluateGrid(models[i], basis, CELLS, mesh,
+						4);
+		mesh_time += now() - t;
+
+		t = now();
+		for (i = 0; i < count; i++)
+			refEvaluateGrid(&ref[i], ref_mesh);
+		ref_mesh_time += now() - t;
+
+		/* Compare the last window's mesh, both are still hot. */
+		for (j = 0; j < (int) (sizeof mesh / sizeof mesh[0]); j++) {
+			d = fabsf(mesh[j] - ref_mesh[j]);
+			if (d > drift)
+				drift = d;
+		}
+	}
+
+	printf("%d windows, %d frames\n", count, FRAMES);
+	printf("solver: %8.2f us/frame, reference %8.2f us/frame\n",
+	       step_time * 1e6 / FRAMES, ref_step_time * 1e6 / FRAMES);
+	printf("mesh:   %8.2f us/frame, reference %8.2f us/frame\n",
+	       mesh_time * 1e6 / FRAMES, ref_mesh_time * 1e6 / FRAMES);
+	printf("largest difference to reference: %g pixels\n", drift);
+
+	for (i = 0; i < count; i++)
+		free(models[i]);
+	free(models);
+	free(ref);
+
+	return 0;
+}
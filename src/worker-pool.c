@@ -0,0 +1,176 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "compositor.h"
+
+/* Threads running the items of one batch at a time. The caller of
+ * weston_worker_pool_run() and the workers pick items until all of
+ * them are done, so a pool of N threads runs a batch on N + 1.
+ */
+struct weston_worker_pool {
+	int num_threads;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int destroying;
+
+	/* The batch being run, count is 0 between batches. */
+	weston_worker_func_t func;
+	void *data;
+	int count;
+	int next;
+	int done;
+};
+
+/* Called with the mutex held, returns with it held. Runs items until
+ * none are left to pick. */
+static void
+worker_pool_run_pending(struct weston_worker_pool *pool)
+{
+	int item;
+
+	while (pool->next < pool->count) {
+		item = pool->next++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool->func(pool->data, item);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (++pool->done == pool->count)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+worker_pool_thread(void *data)
+{
+	struct weston_worker_pool *pool = data;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->destroying) {
+		worker_pool_run_pending(pool);
+		pthread_cond_wait(&pool->work_cond, &pool->mutex);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/* Starts up to num_threads workers. Returns NULL if none could be
+ * started, check weston_worker_pool_get_num_threads() for the count.
+ */
+WL_EXPORT struct weston_worker_pool *
+weston_worker_pool_create(int num_threads)
+{
+	struct weston_worker_pool *pool;
+	int i;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(num_threads, sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   worker_pool_thread, pool) != 0)
+			break;
+	}
+
+	pool->num_threads = i;
+	if (i == 0) {
+		weston_worker_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+WL_EXPORT void
+weston_worker_pool_destroy(struct weston_worker_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->destroying = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool->threads);
+	free(pool);
+}
+
+WL_EXPORT int
+weston_worker_pool_get_num_threads(struct weston_worker_pool *pool)
+{
+	return pool->num_threads;
+}
+
+/* Calls func(data, item) for every item below count, spread over the
+ * workers and the calling thread, and returns once all calls did.
+ */
+WL_EXPORT void
+weston_worker_pool_run(struct weston_worker_pool *pool, int count,
+		       weston_worker_func_t func, void *data)
+{
+	if (count == 0)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	pool->func = func;
+	pool->data = data;
+	pool->count = count;
+	pool->next = 0;
+	pool->done = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	worker_pool_run_pending(pool);
+	while (pool->done < pool->count)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->count = 0;
+
+	pthread_mutex_unlock(&pool->mutex);
+}
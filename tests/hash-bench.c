@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark for the hash table behind the XWayland window map. Fills
+ * tables the size of 1000, 10000 and 100000 windows with X ids, then
+ * reports nanoseconds per lookup hit, lookup miss, and remove plus
+ * insert of a window:
+ *
+ *	./hash-bench
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../xwayland/hash.h"
+
+#define NUM_OPS 2000000
+
+static const int window_counts[] = { 1000, 10000, 100000 };
+
+static double
+timespec_diff(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* X ids: a resource base per client in the high bits, a counter below.
+ * Each window also has a frame window, created right after it. */
+static uint32_t
+window_id(int i)
+{
+	return ((uint32_t) (i % 16 + 1) << 21) | (uint32_t) (i / 16 * 2 + 1);
+}
+
+static void
+run_bench(int count)
+{
+	struct hash_table *ht;
+	struct timespec start, end;
+	uint32_t *ids;
+	char *values;
+	double insert_time, hit_time, miss_time, churn_time;
+	void *sink = NULL;
+	int i, j;
+
+	ids = calloc(NUM_OPS, sizeof *ids);
+	values = calloc(count, 1);
+	assert(ids && values);
+
+	ht = hash_table_create();
+	assert(ht);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < count; i++)
+		hash_table_insert(ht, window_id(i), &values[i]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	insert_time = timespec_diff(&start, &end);
+
+	for (i = 0; i < NUM_OPS; i++)
+		ids[i] = window_id(rand() % count);
+
+	/* Each lookup depends on the previous one like X events handled
+	 * one after the other, so this measures latency, not how many
+	 * lookups the CPU can overlap. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_OPS; i++)
+		sink = hash_table_lookup(ht, ids[i] + (i > 0 && sink == NULL));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	hit_time = timespec_diff(&start, &end);
+	assert(sink);
+
+	/* Frame windows and ids of other clients aren't in the table */
+	for (i = 0; i < NUM_OPS; i++)
+		ids[i] = window_id(rand() % count) + 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_OPS; i++)
+		sink = hash_table_lookup(ht, ids[i] + (sink != NULL));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	miss_time = timespec_diff(&start, &end);
+	assert(!sink);
+
+	/* Windows are destroyed and new ones take fresh ids */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_OPS; i++) {
+		j = i % count;
+		hash_table_remove(ht, window_id(j + i / count * count));
+		hash_table_insert(ht, window_id(j + (i / count + 1) * count),
+				  &values[j]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	churn_time = timespec_diff(&start, &end);
+
+	printf("%6d windows: insert %6.1f ns, hit %6.1f ns, "
+	       "miss %6.1f ns, remove+insert %6.1f ns\n", count,
+	       insert_time * 1e9 / count, hit_time * 1e9 / NUM_OPS,
+	       miss_time * 1e9 / NUM_OPS, churn_time * 1e9 / NUM_OPS);
+
+	hash_table_destroy(ht);
+	free(values);
+	free(ids);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	srand(1);
+
+	for (i = 0; i < sizeof window_counts / sizeof window_counts[0]; i++)
+		run_bench(window_counts[i]);
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "weston-test-runner.h"
+
+#include "../xwayland/hash.h"
+
+#define NUM_KEYS 20000
+
+/* X ids: a resource base per client in the high bits, a counter below */
+static uint32_t
+test_key(int i)
+{
+	return ((uint32_t) (i % 7 + 1) << 21) | (uint32_t) (i / 7 + 1);
+}
+
+static void
+count_entry(void *element, void *data)
+{
+	int *count = data;
+
+	(*count)++;
+}
+
+static int
+count_entries(struct hash_table *ht)
+{
+	int count = 0;
+
+	hash_table_for_each(ht, count_entry, &count);
+
+	return count;
+}
+
+TEST(hash_table_insert_lookup)
+{
+	struct hash_table *ht;
+	char *values;
+	int i;
+
+	values = calloc(NUM_KEYS, 1);
+	assert(values);
+	ht = hash_table_create();
+	assert(ht);
+
+	for (i = 0; i < NUM_KEYS; i++) {
+		assert(hash_table_insert(ht, test_key(i), &values[i]) == 0);
+
+		/* Entries stay visible while the table grows */
+		assert(hash_table_lookup(ht, test_key(i)) == &values[i]);
+		assert(hash_table_lookup(ht, test_key(i / 2)) ==
+		       &values[i / 2]);
+	}
+
+	for (i = 0; i < NUM_KEYS; i++)
+		assert(hash_table_lookup(ht, test_key(i)) == &values[i]);
+	for (i = NUM_KEYS; i < 2 * NUM_KEYS; i++)
+		assert(hash_table_lookup(ht, test_key(i)) == NULL);
+
+	assert(count_entries(ht) == NUM_KEYS);
+
+	hash_table_destroy(ht);
+	free(values);
+}
+
+TEST(hash_table_churn)
+{
+	struct hash_table *ht;
+	char *values, *present;
+	int i, j, live = 0;
+
+	values = calloc(NUM_KEYS, 1);
+	present = calloc(NUM_KEYS, 1);
+	assert(values && present);
+	ht = hash_table_create();
+	assert(ht);
+	srand(1);
+
+	/* Windows come and go, leaving tombstones behind and making the
+	 * table grow and compact while lookups go on. */
+	for (i = 0; i < 20 * NUM_KEYS; i++) {
+		j = rand() % (live < NUM_KEYS / 4 ? NUM_KEYS / 2 : NUM_KEYS);
+
+		if (present[j]) {
+			hash_table_remove(ht, test_key(j));
+			present[j] = 0;
+			live--;
+		} else {
+			assert(hash_table_insert(ht, test_key(j),
+						 &values[j]) == 0);
+			present[j] = 1;
+			live++;
+		}
+
+		j = rand() % NUM_KEYS;
+		assert(hash_table_lookup(ht, test_key(j)) ==
+		       (present[j] ? &values[j] : NULL));
+
+		if (i % NUM_KEYS == 0)
+			assert(count_entries(ht) == live);
+	}
+
+	for (j = 0; j < NUM_KEYS; j++)
+		assert(hash_table_lookup(ht, test_key(j)) ==
+		       (present[j] ? &values[j] : NULL));
+	assert(count_entries(ht) == live);
+
+	hash_table_destroy(ht);
+	free(present);
+	free(values);
+}
+
+TEST(hash_table_remove_missing)
+{
+	struct hash_table *ht;
+	char values[64];
+	int i;
+
+	ht = hash_table_create();
+	assert(ht);
+
+	for (i = 0; i < 64; i += 2)
+		assert(hash_table_insert(ht, test_key(i), &values[i]) == 0);
+
+	/* Removing keys that aren't there changes nothing */
+	for (i = 1; i < 64; i += 2)
+		hash_table_remove(ht, test_key(i));
+	hash_table_remove(ht, test_key(0));
+	hash_table_remove(ht, test_key(0));
+
+	for (i = 2; i < 64; i += 2)
+		assert(hash_table_lookup(ht, test_key(i)) == &values[i]);
+	assert(hash_table_lookup(ht, test_key(0)) == NULL);
+	assert(count_entries(ht) == 31);
+
+	hash_table_destroy(ht);
+}
+
+struct remove_data {
+	struct hash_table *ht;
+	char *values;
+	char *seen;
+};
+
+static void
+remove_entry(void *element, void *data)
+{
+	struct remove_data *rd = data;
+	char *value = element;
+	int i = value - rd->values;
+
+	assert(!rd->seen[i]);
+	rd->seen[i] = 1;
+	hash_table_remove(rd->ht, test_key(i));
+}
+
+TEST(hash_table_remove_while_iterating)
+{
+	struct remove_data rd;
+	char *values;
+	int i;
+
+	values = calloc(NUM_KEYS, 1);
+	rd.seen = calloc(NUM_KEYS, 1);
+	assert(values && rd.seen);
+	rd.ht = hash_table_create();
+	rd.values = values;
+	assert(rd.ht);
+
+	/* Stop right after a resize started, so both tables are walked */
+	for (i = 0; i < 6145; i++)
+		assert(hash_table_insert(rd.ht, test_key(i), &values[i]) == 0);
+
+	hash_table_for_each(rd.ht, remove_entry, &rd);
+
+	for (i = 0; i < 6145; i++) {
+		assert(rd.seen[i]);
+		assert(hash_table_lookup(rd.ht, test_key(i)) == NULL);
+	}
+	assert(count_entries(rd.ht) == 0);
+
+	hash_table_destroy(rd.ht);
+	free(rd.seen);
+	free(values);
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark for weston_compositor_pick_view(). Maps 10, 100 and 1000
+ * views at random positions and reports picks per second, compared to
+ * a linear walk of the view list. Run it like a module test:
+ *
+ *	tests/weston-tests-env pick-bench.la
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../src/compositor.h"
+
+#define NUM_PICKS 200000
+
+static const int view_counts[] = { 10, 100, 1000 };
+
+struct pick_bench {
+	struct weston_compositor *compositor;
+	struct weston_layer layer;
+	struct wl_event_source *timer;
+	struct weston_surface **surfaces;
+	wl_fixed_t *points;
+	int round;
+	int count;
+};
+
+static struct weston_view *
+linear_pick_view(struct weston_compositor *compositor,
+		 wl_fixed_t x, wl_fixed_t y,
+		 wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		weston_view_from_global_fixed(view, x, y, vx, vy);
+		if (pixman_region32_contains_point(&view->surface->input,
+						   wl_fixed_to_int(*vx),
+						   wl_fixed_to_int(*vy),
+						   NULL))
+			return view;
+	}
+
+	return NULL;
+}
+
+static double
+timespec_diff(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static void
+map_views(struct pick_bench *bench, struct weston_output *output)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+	int32_t width, height;
+	int i;
+
+	bench->count = view_counts[bench->round];
+	bench->surfaces = calloc(bench->count, sizeof *bench->surfaces);
+	assert(bench->surfaces);
+
+	for (i = 0; i < bench->count; i++) {
+		surface = weston_surface_create(bench->compositor);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		width = 50 + rand() % 400;
+		height = 50 + rand() % 300;
+		weston_surface_set_size(surface, width, height);
+		pixman_region32_fini(&surface->input);
+		pixman_region32_init_rect(&surface->input,
+					  0, 0, width, height);
+
+		weston_view_set_position(view,
+					 output->x + rand() % output->width,
+					 output->y + rand() % output->height);
+		wl_list_insert(&bench->layer.view_list, &view->layer_link);
+		weston_view_update_transform(view);
+
+		bench->surfaces[i] = surface;
+	}
+}
+
+static void
+unmap_views(struct pick_bench *bench)
+{
+	int i;
+
+	for (i = 0; i < bench->count; i++)
+		weston_surface_destroy(bench->surfaces[i]);
+	free(bench->surfaces);
+	bench->surfaces = NULL;
+}
+
+static void
+run_picks(struct pick_bench *bench)
+{
+	struct weston_compositor *compositor = bench->compositor;
+	struct weston_view *a, *b;
+	struct timespec start, end;
+	wl_fixed_t vx, vy;
+	double grid_time, linear_time;
+	int i;
+
+	/* Both pickers must agree before we compare their speed. */
+	for (i = 0; i < NUM_PICKS; i += 2) {
+		a = weston_compositor_pick_view(compositor, bench->points[i],
+						bench->points[i + 1], &vx, &vy);
+		b = linear_pick_view(compositor, bench->points[i],
+				     bench->points[i + 1], &vx, &vy);
+		assert(a == b);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_PICKS; i += 2)
+		weston_compositor_pick_view(compositor, bench->points[i],
+					    bench->points[i + 1], &vx, &vy);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	grid_time = timespec_diff(&start, &end);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_PICKS; i += 2)
+		linear_pick_view(compositor, bench->points[i],
+				 bench->points[i + 1], &vx, &vy);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	linear_time = timespec_diff(&start, &end);
+
+	fprintf(stderr, "%5d views: %10.0f picks/s indexed, "
+		"%10.0f picks/s linear\n", bench->count,
+		NUM_PICKS / 2 / grid_time, NUM_PICKS / 2 / linear_time);
+}
+
+static int
+bench_step(void *data)
+{
+	struct pick_bench *bench = data;
+	struct weston_output *output;
+	int i;
+
+	output = container_of(bench->compositor->output_list.next,
+			      struct weston_output, link);
+
+	/* The views mapped last round have been through a repaint. */
+	if (bench->surfaces) {
+		run_picks(bench);
+		unmap_views(bench);
+		bench->round++;
+	}
+
+	if (bench->round == ARRAY_LENGTH(view_counts)) {
+		wl_display_terminate(bench->compositor->wl_display);
+		wl_event_source_remove(bench->timer);
+		wl_list_remove(&bench->layer.link);
+		free(bench->points);
+		free(bench);
+		return 1;
+	}
+
+	for (i = 0; i < NUM_PICKS; i += 2) {
+		bench->points[i] = wl_fixed_from_int(output->x +
+						     rand() % output->width);
+		bench->points[i + 1] = wl_fixed_from_int(output->y +
+							 rand() % output->height);
+	}
+
+	map_views(bench, output);
+	weston_compositor_schedule_repaint(bench->compositor);
+	wl_event_source_timer_update(bench->timer, 100);
+
+	return 1;
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct pick_bench *bench;
+
+	bench = zalloc(sizeof *bench);
+	if (!bench)
+		return -1;
+
+	bench->points = calloc(NUM_PICKS, sizeof *bench->points);
+	if (!bench->points) {
+		free(bench);
+		return -1;
+	}
+
+	bench->compositor = compositor;
+	weston_layer_init(&bench->layer, &compositor->cursor_layer.link);
+	srand(1);
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	bench->timer = wl_event_loop_add_timer(loop, bench_step, bench);
+	wl_event_source_timer_update(bench->timer, 100);
+
+	return 0;
+}
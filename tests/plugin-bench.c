@@ -0,0 +1,311 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark for plugin hook dispatch at 500 mapped views. Runs the
+ * per-view paint hooks of a plugin through WESTON_PLUGIN_CALL_VIEW with
+ * the state kept in a weston_view::plugin_data slot, with the list walk
+ * plugins used before, and with no view carrying plugin data, and
+ * reports the time per frame. Run it like a module test:
+ *
+ *	tests/weston-tests-env plugin-bench.la
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../src/compositor.h"
+
+#define NUM_VIEWS 500
+#define NUM_FRAMES 20
+/* The list walk takes over half a second a frame at NUM_VIEWS. */
+#define NUM_LIST_FRAMES 2
+
+struct bench_state {
+	struct weston_surface *surface;
+	struct wl_list link;
+	int synced;
+	uint32_t hits;
+};
+
+struct plugin_bench {
+	struct weston_compositor *compositor;
+	struct weston_layer layer;
+	struct wl_event_source *timer;
+	struct weston_surface *surfaces[NUM_VIEWS];
+	struct bench_state states[NUM_VIEWS];
+	struct wl_list state_list;
+	struct weston_plugin plugin;
+	int slot;
+};
+
+static struct plugin_bench *bench;
+
+static struct bench_state *
+slot_get_state(struct weston_view *view)
+{
+	return view->plugin_data[bench->slot];
+}
+
+/* The lookup wobbly did before it had a slot: a walk of its state list
+ * with a second walk inside for every entry of the first. */
+static struct bench_state *
+list_get_surface(struct weston_surface *surface)
+{
+	struct bench_state *state;
+
+	wl_list_for_each(state, &bench->state_list, link)
+		if (state->surface == surface)
+			return state;
+
+	return NULL;
+}
+
+static struct bench_state *
+list_get_state(struct weston_view *view)
+{
+	struct bench_state *state, *next;
+
+	wl_list_for_each_safe(state, next, &bench->state_list, link)
+		if ((state = list_get_surface(view->surface)) &&
+		    !state->synced)
+			return state;
+
+	return NULL;
+}
+
+#define BENCH_HOOKS(prefix, lookup)					\
+static void								\
+prefix##_prepare_paint(struct weston_view *view, int ms, int *needs_paint) \
+{									\
+	struct bench_state *state = lookup(view);			\
+									\
+	*needs_paint = 1;						\
+	if (state)							\
+		state->hits++;						\
+}									\
+									\
+static void								\
+prefix##_view_hook(struct weston_view *view)				\
+{									\
+	struct bench_state *state = lookup(view);			\
+									\
+	if (state)							\
+		state->hits++;						\
+}									\
+									\
+static void								\
+prefix##_compute_bbox(struct weston_view *view, pixman_region32_t *bbox) \
+{									\
+	struct bench_state *state = lookup(view);			\
+									\
+	if (state)							\
+		state->hits++;						\
+}									\
+									\
+static struct weston_plugin_interface prefix##_interface = {		\
+	.prepare_paint = prefix##_prepare_paint,			\
+	.add_geometry = prefix##_view_hook,				\
+	.paint_view = prefix##_view_hook,				\
+	.done_paint = prefix##_view_hook,				\
+	.compute_bbox = prefix##_compute_bbox,				\
+};
+
+BENCH_HOOKS(slot, slot_get_state)
+BENCH_HOOKS(list, list_get_state)
+
+static double
+timespec_diff(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static void
+map_views(struct weston_output *output)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+	int i;
+
+	wl_list_init(&bench->state_list);
+
+	for (i = 0; i < NUM_VIEWS; i++) {
+		surface = weston_surface_create(bench->compositor);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		weston_surface_set_size(surface, 50 + rand() % 400,
+					50 + rand() % 300);
+		weston_view_set_position(view,
+					 output->x + rand() % output->width,
+					 output->y + rand() % output->height);
+		wl_list_insert(&bench->layer.view_list, &view->layer_link);
+		weston_view_update_transform(view);
+
+		/* Every tenth window is animating, the rest are at rest
+		 * and cost the list lookup a full walk. */
+		bench->states[i].surface = surface;
+		bench->states[i].synced = i % 10 != 0;
+		wl_list_insert(&bench->state_list, &bench->states[i].link);
+		weston_view_set_plugin_data(view, bench->slot,
+					    &bench->states[i]);
+
+		bench->surfaces[i] = surface;
+	}
+}
+
+/* Calls the per-view hooks the way gl-renderer and
+ * weston_view_update_transform() do during a repaint. */
+static uint32_t
+run_frames(struct weston_plugin_interface *interface, int frames)
+{
+	struct weston_compositor *compositor = bench->compositor;
+	struct weston_view *view;
+	pixman_region32_t bbox;
+	uint32_t hits = 0;
+	int i, needs_paint;
+
+	bench->plugin.interface = interface;
+	for (i = 0; i < NUM_VIEWS; i++)
+		bench->states[i].hits = 0;
+
+	pixman_region32_init(&bbox);
+	for (i = 0; i < frames; i++) {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			WESTON_PLUGIN_CALL_VIEW(compositor, prepare_paint,
+						view, 16, &needs_paint);
+			WESTON_PLUGIN_CALL_VIEW(compositor, compute_bbox,
+						view, &bbox);
+			WESTON_PLUGIN_CALL_VIEW(compositor, add_geometry,
+						view);
+			WESTON_PLUGIN_CALL_VIEW(compositor, paint_view, view);
+			WESTON_PLUGIN_CALL_VIEW(compositor, done_paint, view);
+		}
+	}
+	pixman_region32_fini(&bbox);
+
+	for (i = 0; i < NUM_VIEWS; i++)
+		hits += bench->states[i].hits;
+
+	return hits;
+}
+
+static int
+bench_step(void *data)
+{
+	struct weston_compositor *compositor = bench->compositor;
+	struct weston_view *view;
+	struct timespec start, end;
+	double slot_time, list_time, idle_time;
+	uint32_t slot_hits, list_hits, idle_hits, hooks;
+	int i;
+
+	/* Register the hooks like a plugin loaded from the config. */
+	hooks = compositor->plugin_hooks;
+	compositor->plugin_hooks |=
+		1u << WESTON_PLUGIN_HOOK(prepare_paint) |
+		1u << WESTON_PLUGIN_HOOK(compute_bbox) |
+		1u << WESTON_PLUGIN_HOOK(add_geometry) |
+		1u << WESTON_PLUGIN_HOOK(paint_view) |
+		1u << WESTON_PLUGIN_HOOK(done_paint);
+	wl_list_insert(&compositor->plugin_list, &bench->plugin.link);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	slot_hits = run_frames(&slot_interface, NUM_FRAMES);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	slot_time = timespec_diff(&start, &end);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	list_hits = run_frames(&list_interface, NUM_LIST_FRAMES);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	list_time = timespec_diff(&start, &end);
+
+	/* Views no plugin cares about take the fast path. */
+	wl_list_for_each(view, &compositor->view_list, link)
+		weston_view_set_plugin_data(view, bench->slot, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	idle_hits = run_frames(&slot_interface, NUM_FRAMES);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	idle_time = timespec_diff(&start, &end);
+
+	wl_list_remove(&bench->plugin.link);
+	compositor->plugin_hooks = hooks;
+
+	/* The slot finds every state, the list only the unsynced ones. */
+	assert(slot_hits >= list_hits && list_hits > 0);
+	assert(idle_hits == 0);
+
+	fprintf(stderr, "%d views: %10.1f us/frame slot, "
+		"%10.1f us/frame list, %10.1f us/frame no plugin data\n",
+		NUM_VIEWS, slot_time * 1e6 / NUM_FRAMES,
+		list_time * 1e6 / NUM_LIST_FRAMES, idle_time * 1e6 / NUM_FRAMES);
+
+
+	for (i = 0; i < NUM_VIEWS; i++)
+		weston_surface_destroy(bench->surfaces[i]);
+
+	weston_plugin_slot_free(compositor, bench->slot);
+	wl_list_remove(&bench->layer.link);
+	wl_event_source_remove(bench->timer);
+	wl_display_terminate(compositor->wl_display);
+	free(bench);
+
+	return 1;
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct weston_output *output;
+
+	bench = zalloc(sizeof *bench);
+	if (!bench)
+		return -1;
+
+	bench->compositor = compositor;
+	bench->slot = weston_plugin_slot_alloc(compositor);
+	if (bench->slot < 0) {
+		free(bench);
+		return -1;
+	}
+
+	bench->plugin.name = "plugin-bench";
+	weston_layer_init(&bench->layer, &compositor->cursor_layer.link);
+	srand(1);
+
+	output = container_of(compositor->output_list.next,
+			      struct weston_output, link);
+	map_views(output);
+	weston_compositor_schedule_repaint(compositor);
+
+	/* Start once the views have been through a repaint. */
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	bench->timer = wl_event_loop_add_timer(loop, bench_step, bench);
+	wl_event_source_timer_update(bench->timer, 100);
+
+	return 0;
+}
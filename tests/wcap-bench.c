@@ -0,0 +1,195 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark for the wcap delta/RLE kernels. Encodes and decodes a
+ * sequence of synthetic 4K frames with every implementation the CPU
+ * supports, checks that they all produce the same bytes as the scalar
+ * code and reports MB/s of pixel data in each direction:
+ *
+ *	./wcap-bench
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../wcap/wcap-decode.h"
+#include "../wcap/wcap-rle.h"
+
+#define WIDTH 3840
+#define HEIGHT 2160
+#define NUM_FRAMES 16
+
+struct encoded_frame {
+	uint32_t *data;
+	int size;
+};
+
+static double
+timespec_diff(struct timespec *a, struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* A desktop-like scene: a flat background with a gradient panel, a
+ * window that moves every frame and a strip of noise standing in for
+ * video or text. */
+static void
+draw_frame(uint32_t *pixels, int frame)
+{
+	int x, y, wx, wy;
+
+	for (y = 0; y < HEIGHT; y++)
+		for (x = 0; x < WIDTH; x++)
+			pixels[y * WIDTH + x] = 0xff204060;
+
+	for (y = 0; y < 64; y++)
+		for (x = 0; x < WIDTH; x++)
+			pixels[y * WIDTH + x] = 0xff000000 | (x * 255 / WIDTH);
+
+	wx = 200 + frame * 37;
+	wy = 300 + frame * 11;
+	for (y = wy; y < wy + 900; y++)
+		for (x = wx; x < wx + 1400; x++)
+			pixels[y * WIDTH + x] = (x - wx) % 160 < 8 ?
+				0xff101010 : 0xffe0e0e0;
+
+	for (y = 1600; y < 1700; y++)
+		for (x = 0; x < 1280; x++)
+			pixels[y * WIDTH + x] = 0xff000000 | rand();
+}
+
+static int
+encode_frame(uint32_t *out, uint32_t *frame, const uint32_t *pixels)
+{
+	struct wcap_rle_state state;
+	uint32_t *p = out;
+	int y;
+
+	memset(&state, 0, sizeof state);
+	for (y = 0; y < HEIGHT; y++)
+		p = wcap_rle_encode_span(p, &state, frame + y * WIDTH,
+					 pixels + y * WIDTH, WIDTH);
+	p = wcap_rle_finish(p, &state);
+
+	return p - out;
+}
+
+static void
+run_impl(enum wcap_rle_impl impl, uint32_t **input,
+	 struct encoded_frame *reference, uint32_t *reference_frame)
+{
+	static const struct wcap_rectangle rect = { 0, 0, WIDTH, HEIGHT };
+	struct timespec start, end;
+	double encode_time = 0, decode_time = 0, mb;
+	uint32_t *frame, *out, *p;
+	int i, size;
+
+	frame = calloc(WIDTH * HEIGHT, sizeof *frame);
+	out = malloc(WIDTH * HEIGHT * sizeof *out);
+	assert(frame && out);
+
+	for (i = 0; i < NUM_FRAMES; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		size = encode_frame(out, frame, input[i]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		encode_time += timespec_diff(&start, &end);
+
+		if (reference[i].data == NULL) {
+			reference[i].data = malloc(size * sizeof *out);
+			assert(reference[i].data);
+			memcpy(reference[i].data, out, size * sizeof *out);
+			reference[i].size = size;
+		} else {
+			assert(size == reference[i].size);
+			assert(memcmp(out, reference[i].data,
+				      size * sizeof *out) == 0);
+		}
+	}
+
+	memset(frame, 0, WIDTH * HEIGHT * sizeof *frame);
+	for (i = 0; i < NUM_FRAMES; i++) {
+		p = reference[i].data;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		size = wcap_rle_decode_rectangle(&p, frame, WIDTH, &rect);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		decode_time += timespec_diff(&start, &end);
+
+		assert(size == WIDTH * HEIGHT);
+		assert(p == reference[i].data + reference[i].size);
+	}
+
+	if (impl == WCAP_RLE_SCALAR)
+		memcpy(reference_frame, frame, WIDTH * HEIGHT * sizeof *frame);
+	else
+		assert(memcmp(frame, reference_frame,
+			      WIDTH * HEIGHT * sizeof *frame) == 0);
+
+	mb = (double) NUM_FRAMES * WIDTH * HEIGHT * 4 / (1024 * 1024);
+	printf("%-8s encode %8.1f MB/s, decode %8.1f MB/s\n",
+	       wcap_rle_impl_name(impl), mb / encode_time, mb / decode_time);
+
+	free(frame);
+	free(out);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct encoded_frame reference[NUM_FRAMES];
+	uint32_t *input[NUM_FRAMES], *reference_frame;
+	int i, impl;
+
+	srand(1);
+	for (i = 0; i < NUM_FRAMES; i++) {
+		input[i] = malloc(WIDTH * HEIGHT * sizeof *input[i]);
+		assert(input[i]);
+		draw_frame(input[i], i);
+	}
+
+	reference_frame = malloc(WIDTH * HEIGHT * sizeof *reference_frame);
+	assert(reference_frame);
+	memset(reference, 0, sizeof reference);
+
+	for (impl = 0; impl < WCAP_RLE_NUM_IMPLS; impl++) {
+		if (wcap_rle_select(impl) < 0) {
+			printf("%-8s not supported\n",
+			       wcap_rle_impl_name(impl));
+			continue;
+		}
+		run_impl(impl, input, reference, reference_frame);
+	}
+
+	for (i = 0; i < NUM_FRAMES; i++) {
+		free(input[i]);
+		free(reference[i].data);
+	}
+	free(reference_frame);
+
+	return 0;
+}
@@ -36,44 +36,17 @@
 #include <cairo.h>
 
 #include "wcap-decode.h"
+#include "wcap-rle.h"
 
 static void
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			      struct wcap_rectangle *rect)
 {
-	uint32_t v, *p = decoder->p, *d;
-	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
-
-	d = decoder->frame + (rect->y2 - 1) * decoder->width;
-	x = rect->x1;
-	i = 0;
-	while (i < count) {
-		v = *p++;
-		l = v >> 24;
-		if (l < 0xe0) {
-			j = l + 1;
-		} else {
-			j = 1 << (l - 0xe0 + 7);
-		}
-
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
-			if (x == rect->x2) {
-				x = rect->x1;
-				d -= decoder->width;
-			}
-		}
-		i += j;
-	}
+	uint32_t *p = decoder->p;
+	int i, count = (rect->x2 - rect->x1) * (rect->y2 - rect->y1);
+
+	i = wcap_rle_decode_rectangle(&p, decoder->frame,
+				      decoder->width, rect);
 
 	if (i != count)
 		printf("rle encoding longer than expected (%d expected %d)\n",
@@ -116,6 +89,8 @@ wcap_decoder_create(const char *filename)
 	if (decoder == NULL)
 		return NULL;
 
+	wcap_rle_init();
+
 	decoder->fd = open(filename, O_RDONLY);
 	if (decoder->fd == -1) {
 		free(decoder);
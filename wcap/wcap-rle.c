@@ -0,0 +1,361 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define WCAP_RLE_X86 1
+#include <immintrin.h>
+#endif
+
+#include "wcap-decode.h"
+#include "wcap-rle.h"
+
+/* The SIMD kernels compute the deltas of a whole vector of pixels at
+ * once and swallow it in one go when it just extends the current run,
+ * which is what most of a screen capture is. Anything else goes
+ * through the same per-pixel step as the scalar code, so the output is
+ * the same byte for byte. */
+
+typedef uint32_t *(*encode_span_func_t)(uint32_t *p,
+					struct wcap_rle_state *state,
+					uint32_t *frame,
+					const uint32_t *pixels, int width);
+typedef void (*apply_delta_func_t)(uint32_t *d, uint32_t delta, int count);
+
+static encode_span_func_t encode_span;
+static apply_delta_func_t apply_delta;
+
+static uint32_t *
+output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+static inline uint32_t
+component_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+static inline uint32_t *
+push_delta(uint32_t *p, struct wcap_rle_state *state, uint32_t delta)
+{
+	if (state->run == 0 || delta == state->prev) {
+		state->run++;
+	} else {
+		p = output_run(p, state->prev, state->run);
+		state->run = 1;
+	}
+	state->prev = delta;
+
+	return p;
+}
+
+static inline uint32_t
+apply_component_delta(uint32_t prev, uint32_t delta)
+{
+	unsigned char r, g, b;
+
+	r = (prev >> 16) + (delta >> 16);
+	g = (prev >>  8) + (delta >>  8);
+	b = (prev >>  0) + (delta >>  0);
+
+	return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+static uint32_t *
+encode_span_scalar(uint32_t *p, struct wcap_rle_state *state,
+		   uint32_t *frame, const uint32_t *pixels, int width)
+{
+	uint32_t next;
+	int k;
+
+	for (k = 0; k < width; k++) {
+		next = pixels[k];
+		p = push_delta(p, state, component_delta(next, frame[k]));
+		frame[k] = next;
+	}
+
+	return p;
+}
+
+static void
+apply_delta_scalar(uint32_t *d, uint32_t delta, int count)
+{
+	int k;
+
+	for (k = 0; k < count; k++)
+		d[k] = apply_component_delta(d[k], delta);
+}
+
+#ifdef WCAP_RLE_X86
+
+__attribute__((target("sse2")))
+static uint32_t *
+encode_span_sse2(uint32_t *p, struct wcap_rle_state *state,
+		 uint32_t *frame, const uint32_t *pixels, int width)
+{
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	uint32_t lanes[4];
+	__m128i next, delta;
+	int i, k;
+
+	for (k = 0; k + 4 <= width; k += 4) {
+		next = _mm_loadu_si128((const __m128i *) (pixels + k));
+		delta = _mm_sub_epi8(next,
+				     _mm_loadu_si128((__m128i *) (frame + k)));
+		delta = _mm_and_si128(delta, mask);
+		_mm_storeu_si128((__m128i *) (frame + k), next);
+
+		if (state->run > 0 &&
+		    _mm_movemask_epi8(_mm_cmpeq_epi32(delta,
+				_mm_set1_epi32(state->prev))) == 0xffff) {
+			state->run += 4;
+			continue;
+		}
+
+		_mm_storeu_si128((__m128i *) lanes, delta);
+		for (i = 0; i < 4; i++)
+			p = push_delta(p, state, lanes[i]);
+	}
+
+	return encode_span_scalar(p, state, frame + k, pixels + k, width - k);
+}
+
+__attribute__((target("sse2")))
+static void
+apply_delta_sse2(uint32_t *d, uint32_t delta, int count)
+{
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	const __m128i v = _mm_set1_epi32(delta & 0x00ffffff);
+	__m128i x;
+	int k;
+
+	for (k = 0; k + 4 <= count; k += 4) {
+		x = _mm_loadu_si128((__m128i *) (d + k));
+		x = _mm_or_si128(_mm_add_epi8(x, v), alpha);
+		_mm_storeu_si128((__m128i *) (d + k), x);
+	}
+
+	apply_delta_scalar(d + k, delta, count - k);
+}
+
+__attribute__((target("avx2")))
+static uint32_t *
+encode_span_avx2(uint32_t *p, struct wcap_rle_state *state,
+		 uint32_t *frame, const uint32_t *pixels, int width)
+{
+	const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+	uint32_t lanes[8];
+	__m256i next, delta;
+	int i, k;
+
+	for (k = 0; k + 8 <= width; k += 8) {
+		next = _mm256_loadu_si256((const __m256i *) (pixels + k));
+		delta = _mm256_sub_epi8(next,
+				_mm256_loadu_si256((__m256i *) (frame + k)));
+		delta = _mm256_and_si256(delta, mask);
+		_mm256_storeu_si256((__m256i *) (frame + k), next);
+
+		if (state->run > 0 &&
+		    _mm256_movemask_epi8(_mm256_cmpeq_epi32(delta,
+				_mm256_set1_epi32(state->prev))) == -1) {
+			state->run += 8;
+			continue;
+		}
+
+		_mm256_storeu_si256((__m256i *) lanes, delta);
+		for (i = 0; i < 8; i++)
+			p = push_delta(p, state, lanes[i]);
+	}
+
+	return encode_span_sse2(p, state, frame + k, pixels + k, width - k);
+}
+
+__attribute__((target("avx2")))
+static void
+apply_delta_avx2(uint32_t *d, uint32_t delta, int count)
+{
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	const __m256i v = _mm256_set1_epi32(delta & 0x00ffffff);
+	__m256i x;
+	int k;
+
+	for (k = 0; k + 8 <= count; k += 8) {
+		x = _mm256_loadu_si256((__m256i *) (d + k));
+		x = _mm256_or_si256(_mm256_add_epi8(x, v), alpha);
+		_mm256_storeu_si256((__m256i *) (d + k), x);
+	}
+
+	apply_delta_sse2(d + k, delta, count - k);
+}
+
+#endif
+
+const char *
+wcap_rle_impl_name(enum wcap_rle_impl impl)
+{
+	switch (impl) {
+	case WCAP_RLE_SCALAR:
+		return "scalar";
+	case WCAP_RLE_SSE2:
+		return "sse2";
+	case WCAP_RLE_AVX2:
+		return "avx2";
+	default:
+		return "unknown";
+	}
+}
+
+/* Switches the encoder and decoder to the given implementation. Returns
+ * -1 and leaves the current one in place if the CPU doesn't support it.
+ * Not thread safe, call it before any encoding or decoding starts. */
+int
+wcap_rle_select(enum wcap_rle_impl impl)
+{
+	switch (impl) {
+	case WCAP_RLE_SCALAR:
+		encode_span = encode_span_scalar;
+		apply_delta = apply_delta_scalar;
+		return 0;
+#ifdef WCAP_RLE_X86
+	case WCAP_RLE_SSE2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("sse2"))
+			return -1;
+		encode_span = encode_span_sse2;
+		apply_delta = apply_delta_sse2;
+		return 0;
+	case WCAP_RLE_AVX2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		encode_span = encode_span_avx2;
+		apply_delta = apply_delta_avx2;
+		return 0;
+#endif
+	default:
+		return -1;
+	}
+}
+
+/* Picks the fastest implementation the CPU supports. */
+void
+wcap_rle_init(void)
+{
+	int impl;
+
+	if (encode_span)
+		return;
+
+	for (impl = WCAP_RLE_NUM_IMPLS - 1; impl >= 0; impl--)
+		if (wcap_rle_select(impl) == 0)
+			break;
+}
+
+/* Delta encodes width pixels against the same span of the previous
+ * frame, which is updated to the new pixels, and appends the runs that
+ * are complete to p. Returns the new end of the output. */
+uint32_t *
+wcap_rle_encode_span(uint32_t *p, struct wcap_rle_state *state,
+		     uint32_t *frame, const uint32_t *pixels, int width)
+{
+	return encode_span(p, state, frame, pixels, width);
+}
+
+/* Writes out the run still pending at the end of a rectangle. */
+uint32_t *
+wcap_rle_finish(uint32_t *p, struct wcap_rle_state *state)
+{
+	p = output_run(p, state->prev, state->run);
+	state->run = 0;
+
+	return p;
+}
+
+/* Applies the runs at *p to rect of frame, bottom row first, and
+ * advances *p past them. Returns the number of pixels the runs cover,
+ * which only differs from the size of rect for a corrupt file. */
+int
+wcap_rle_decode_rectangle(uint32_t **p, uint32_t *frame, int stride,
+			  const struct wcap_rectangle *rect)
+{
+	uint32_t v, *s = *p, *d;
+	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
+	int x, i, j, l, n, left, count = width * height;
+
+	d = frame + (rect->y2 - 1) * stride;
+	x = rect->x1;
+	i = 0;
+	while (i < count) {
+		v = *s++;
+		l = v >> 24;
+		if (l < 0xe0) {
+			j = l + 1;
+		} else {
+			j = 1 << (l - 0xe0 + 7);
+		}
+
+		/* A run longer than what's left of the rectangle is cut
+		 * short rather than written past the frame. */
+		left = j < count - i ? j : count - i;
+		for (; left > 0; left -= n) {
+			n = rect->x2 - x;
+			if (n > left)
+				n = left;
+			apply_delta(d + x, v, n);
+			x += n;
+			if (x == rect->x2) {
+				x = rect->x1;
+				d -= stride;
+			}
+		}
+		i += j;
+	}
+
+	*p = s;
+
+	return i;
+}
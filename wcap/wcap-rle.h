@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2014 Scott Moreau
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _WCAP_RLE_
+#define _WCAP_RLE_
+
+#include <stdint.h>
+
+struct wcap_rectangle;
+
+enum wcap_rle_impl {
+	WCAP_RLE_SCALAR,
+	WCAP_RLE_SSE2,
+	WCAP_RLE_AVX2,
+	WCAP_RLE_NUM_IMPLS
+};
+
+/* Delta/RLE state carried from one span to the next, a run may cross
+ * row boundaries within a rectangle. Zero initialize it for every
+ * rectangle. */
+struct wcap_rle_state {
+	uint32_t prev;
+	int run;
+};
+
+void wcap_rle_init(void);
+int wcap_rle_select(enum wcap_rle_impl impl);
+const char *wcap_rle_impl_name(enum wcap_rle_impl impl);
+
+uint32_t *wcap_rle_encode_span(uint32_t *p, struct wcap_rle_state *state,
+			       uint32_t *frame, const uint32_t *pixels,
+			       int width);
+uint32_t *wcap_rle_finish(uint32_t *p, struct wcap_rle_state *state);
+
+int wcap_rle_decode_rectangle(uint32_t **p, uint32_t *frame, int stride,
+			      const struct wcap_rectangle *rect);
+
+#endif
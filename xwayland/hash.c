@@ -39,6 +39,18 @@
 
 #include "hash.h"
 
+/*
+ * Open addressing with linear probing over a power of two sized table,
+ * so a lookup usually touches a single cache line. Removed entries
+ * leave a tombstone behind unless they end a probe chain.
+ *
+ * Growing, or rebuilding a table cluttered with tombstones, does not
+ * happen all at once: the new table takes all inserts while each
+ * operation moves a few entries over from the old one, except during
+ * hash_table_for_each(). Lookups and removals check both tables until
+ * the old one is empty.
+ */
+
 struct hash_entry {
 	uint32_t hash;
 	void *data;
@@ -46,59 +58,25 @@ struct hash_entry {
 
 struct hash_table {
 	struct hash_entry *table;
-	uint32_t size;
-	uint32_t rehash;
-	uint32_t max_entries;
-	uint32_t size_index;
+	uint32_t size;			/* power of two */
+	uint32_t shift;			/* 32 - log2(size) */
 	uint32_t entries;
 	uint32_t deleted_entries;
-};
 
-#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+	/* The table being emptied by a resize, or NULL */
+	struct hash_entry *old_table;
+	uint32_t old_size;
+	uint32_t old_shift;
+	uint32_t old_entries;
+	uint32_t migrate_index;
 
-/*
- * From Knuth -- a good choice for hash/rehash values is p, p-2 where
- * p and p-2 are both prime.  These tables are sized to have an extra 10%
- * free to avoid exponential performance degradation as the hash table fills
- */
+	int iterating;
+};
 
-static const uint32_t deleted_data;
+#define HASH_MIN_SIZE		8
+#define HASH_MIGRATE_STEP	32
 
-static const struct {
-   uint32_t max_entries, size, rehash;
-} hash_sizes[] = {
-    { 2,		5,		3	  },
-    { 4,		7,		5	  },
-    { 8,		13,		11	  },
-    { 16,		19,		17	  },
-    { 32,		43,		41        },
-    { 64,		73,		71        },
-    { 128,		151,		149       },
-    { 256,		283,		281       },
-    { 512,		571,		569       },
-    { 1024,		1153,		1151      },
-    { 2048,		2269,		2267      },
-    { 4096,		4519,		4517      },
-    { 8192,		9013,		9011      },
-    { 16384,		18043,		18041     },
-    { 32768,		36109,		36107     },
-    { 65536,		72091,		72089     },
-    { 131072,		144409,		144407    },
-    { 262144,		288361,		288359    },
-    { 524288,		576883,		576881    },
-    { 1048576,		1153459,	1153457   },
-    { 2097152,		2307163,	2307161   },
-    { 4194304,		4613893,	4613891   },
-    { 8388608,		9227641,	9227639   },
-    { 16777216,		18455029,	18455027  },
-    { 33554432,		36911011,	36911009  },
-    { 67108864,		73819861,	73819859  },
-    { 134217728,	147639589,	147639587 },
-    { 268435456,	295279081,	295279079 },
-    { 536870912,	590559793,	590559791 },
-    { 1073741824,	1181116273,	1181116271},
-    { 2147483648ul,	2362232233ul,	2362232231ul}
-};
+static const uint32_t deleted_data;
 
 static int
 entry_is_free(struct hash_entry *entry)
@@ -118,22 +96,46 @@ entry_is_present(struct hash_entry *entry)
 	return entry->data != NULL && entry->data != &deleted_data;
 }
 
+/* Fibonacci hashing: X ids from different clients share their low
+ * bits, the multiplication spreads them over the whole table. */
+static uint32_t
+hash_address(uint32_t hash, uint32_t shift)
+{
+	return (hash * 2654435769u) >> shift;
+}
+
+/* Stop at 3/4 full, tombstones included, so probe chains stay short */
+static uint32_t
+hash_max_load(uint32_t size)
+{
+	return size - size / 4;
+}
+
+static uint32_t
+hash_shift(uint32_t size)
+{
+	uint32_t shift = 32;
+
+	while (size > 1) {
+		size >>= 1;
+		shift--;
+	}
+
+	return shift;
+}
+
 struct hash_table *
 hash_table_create(void)
 {
 	struct hash_table *ht;
 
-	ht = malloc(sizeof(*ht));
+	ht = calloc(1, sizeof(*ht));
 	if (ht == NULL)
 		return NULL;
 
-	ht->size_index = 0;
-	ht->size = hash_sizes[ht->size_index].size;
-	ht->rehash = hash_sizes[ht->size_index].rehash;
-	ht->max_entries = hash_sizes[ht->size_index].max_entries;
+	ht->size = HASH_MIN_SIZE;
+	ht->shift = hash_shift(ht->size);
 	ht->table = calloc(ht->size, sizeof(*ht->table));
-	ht->entries = 0;
-	ht->deleted_entries = 0;
 
 	if (ht->table == NULL) {
 		free(ht);
@@ -152,158 +154,270 @@ hash_table_destroy(struct hash_table *ht)
 	if (!ht)
 		return;
 
+	free(ht->old_table);
 	free(ht->table);
 	free(ht);
 }
 
 /**
- * Finds a hash table entry with the given key and hash of that key.
+ * Finds the entry with the given hash in a table.
  *
- * Returns NULL if no entry is found.  Note that the data pointer may be
- * modified by the user.
+ * Returns NULL if no entry is found.
  */
-static void *
-hash_table_search(struct hash_table *ht, uint32_t hash)
+static struct hash_entry *
+table_search(struct hash_entry *table, uint32_t size, uint32_t shift,
+	     uint32_t hash)
 {
-	uint32_t hash_address;
-
-	hash_address = hash % ht->size;
-	do {
-		uint32_t double_hash;
+	struct hash_entry *entry;
+	uint32_t address, i;
 
-		struct hash_entry *entry = ht->table + hash_address;
+	address = hash_address(hash, shift);
+	for (i = 0; i < size; i++) {
+		entry = table + ((address + i) & (size - 1));
 
-		if (entry_is_free(entry)) {
+		if (entry_is_free(entry))
 			return NULL;
-		} else if (entry_is_present(entry) && entry->hash == hash) {
+		else if (entry_is_present(entry) && entry->hash == hash)
 			return entry;
-		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Marks the entry as removed. A tombstone is only needed if a probe
+ * chain goes on past the entry, otherwise the entry and the tombstones
+ * right before it become free again.
+ *
+ * Returns the number of tombstones added, which may be negative.
+ */
+static int
+table_remove_entry(struct hash_entry *table, uint32_t size,
+		   struct hash_entry *entry)
+{
+	uint32_t index = entry - table;
+	int deleted = 0;
 
-		double_hash = 1 + hash % ht->rehash;
+	if (!entry_is_free(table + ((index + 1) & (size - 1)))) {
+		entry->data = (void *) &deleted_data;
+		return 1;
+	}
 
-		hash_address = (hash_address + double_hash) % ht->size;
-	} while (hash_address != hash % ht->size);
+	entry->data = NULL;
+	for (;;) {
+		index = (index - 1) & (size - 1);
+		entry = table + index;
+		if (!entry_is_deleted(entry))
+			break;
+		entry->data = NULL;
+		deleted--;
+	}
 
-	return NULL;
+	return deleted;
 }
 
-void
-hash_table_for_each(struct hash_table *ht,
-		    hash_table_iterator_func_t func, void *data)
+static void
+table_insert(struct hash_table *ht, uint32_t hash, void *data)
 {
 	struct hash_entry *entry;
-	uint32_t i;
+	uint32_t address;
 
-	for (i = 0; i < ht->size; i++) {
-		entry = ht->table + i;
-		if (entry_is_present(entry))
-			func(entry->data, data);
+	address = hash_address(hash, ht->shift);
+	for (;;) {
+		entry = ht->table + address;
+
+		if (!entry_is_present(entry)) {
+			if (entry_is_deleted(entry))
+				ht->deleted_entries--;
+			entry->hash = hash;
+			entry->data = data;
+			ht->entries++;
+			return;
+		}
+
+		address = (address + 1) & (ht->size - 1);
 	}
 }
 
-void *
-hash_table_lookup(struct hash_table *ht, uint32_t hash)
+/**
+ * Moves up to count slots worth of entries from the old table to the
+ * new one, and frees the old table once it is empty.
+ */
+static void
+hash_table_migrate(struct hash_table *ht, uint32_t count)
 {
 	struct hash_entry *entry;
 
-	entry = hash_table_search(ht, hash);
-	if (entry != NULL)
-		return entry->data;
+	while (ht->old_table && count--) {
+		entry = ht->old_table + ht->migrate_index;
 
-	return NULL;
+		/* Leave a tombstone, the entries after it may still be
+		 * looked up in the old table. */
+		if (entry_is_present(entry)) {
+			table_insert(ht, entry->hash, entry->data);
+			entry->data = (void *) &deleted_data;
+			ht->old_entries--;
+		}
+
+		if (++ht->migrate_index == ht->old_size ||
+		    ht->old_entries == 0) {
+			free(ht->old_table);
+			ht->old_table = NULL;
+		}
+	}
 }
 
-static void
-hash_table_rehash(struct hash_table *ht, unsigned int new_size_index)
+/**
+ * Switches inserts to a new, empty table of the given size. The
+ * entries of the current one move over incrementally.
+ */
+static int
+hash_table_resize(struct hash_table *ht, uint32_t new_size)
 {
-	struct hash_table old_ht;
-	struct hash_entry *table, *entry;
+	struct hash_entry *table;
 
-	if (new_size_index >= ARRAY_SIZE(hash_sizes))
-		return;
+	/* Only one resize at a time */
+	hash_table_migrate(ht, ht->old_size);
 
-	table = calloc(hash_sizes[new_size_index].size, sizeof(*ht->table));
+	table = calloc(new_size, sizeof(*table));
 	if (table == NULL)
-		return;
+		return -1;
 
-	old_ht = *ht;
+	ht->old_table = ht->table;
+	ht->old_size = ht->size;
+	ht->old_shift = ht->shift;
+	ht->old_entries = ht->entries;
+	ht->migrate_index = 0;
 
 	ht->table = table;
-	ht->size_index = new_size_index;
-	ht->size = hash_sizes[ht->size_index].size;
-	ht->rehash = hash_sizes[ht->size_index].rehash;
-	ht->max_entries = hash_sizes[ht->size_index].max_entries;
+	ht->size = new_size;
+	ht->shift = hash_shift(new_size);
 	ht->entries = 0;
 	ht->deleted_entries = 0;
 
-	for (entry = old_ht.table;
-	     entry != old_ht.table + old_ht.size;
-	     entry++) {
-		if (entry_is_present(entry)) {
-			hash_table_insert(ht, entry->hash, entry->data);
-		}
+	if (ht->old_entries == 0) {
+		free(ht->old_table);
+		ht->old_table = NULL;
+	}
+
+	return 0;
+}
+
+void
+hash_table_for_each(struct hash_table *ht,
+		    hash_table_iterator_func_t func, void *data)
+{
+	struct hash_entry *entry;
+	uint32_t i;
+
+	ht->iterating++;
+
+	for (i = 0; i < ht->size; i++) {
+		entry = ht->table + i;
+		if (entry_is_present(entry))
+			func(entry->data, data);
+	}
+
+	for (i = 0; ht->old_table && i < ht->old_size; i++) {
+		entry = ht->old_table + i;
+		if (entry_is_present(entry))
+			func(entry->data, data);
 	}
 
-	free(old_ht.table);
+	ht->iterating--;
+}
+
+void *
+hash_table_lookup(struct hash_table *ht, uint32_t hash)
+{
+	struct hash_entry *entry;
+
+	if (!ht->iterating)
+		hash_table_migrate(ht, HASH_MIGRATE_STEP);
+
+	/* Entries whose chain starts past the migrated part of the old
+	 * table are most likely still in there. */
+	if (ht->old_table &&
+	    hash_address(hash, ht->old_shift) >= ht->migrate_index) {
+		entry = table_search(ht->old_table, ht->old_size,
+				     ht->old_shift, hash);
+		if (entry == NULL)
+			entry = table_search(ht->table, ht->size,
+					     ht->shift, hash);
+	} else {
+		entry = table_search(ht->table, ht->size, ht->shift, hash);
+		if (entry == NULL && ht->old_table)
+			entry = table_search(ht->old_table, ht->old_size,
+					     ht->old_shift, hash);
+	}
+
+	if (entry != NULL)
+		return entry->data;
+
+	return NULL;
 }
 
 /**
  * Inserts the data with the given hash into the table.
  *
- * Note that insertion may rearrange the table on a resize or rehash,
- * so previously found hash_entries are no longer valid after this function.
+ * Note that insertion may move entries between tables, so previously
+ * found hash_entries are no longer valid after this function.
  */
 int
 hash_table_insert(struct hash_table *ht, uint32_t hash, void *data)
 {
-	uint32_t hash_address;
-
-	if (ht->entries >= ht->max_entries) {
-		hash_table_rehash(ht, ht->size_index + 1);
-	} else if (ht->deleted_entries + ht->entries >= ht->max_entries) {
-		hash_table_rehash(ht, ht->size_index);
-	}
-
-	hash_address = hash % ht->size;
-	do {
-		struct hash_entry *entry = ht->table + hash_address;
-		uint32_t double_hash;
-
-		if (!entry_is_present(entry)) {
-			if (entry_is_deleted(entry))
-				ht->deleted_entries--;
-			entry->hash = hash;
-			entry->data = data;
-			ht->entries++;
-			return 0;
+	uint32_t entries, new_size;
+
+	hash_table_migrate(ht, HASH_MIGRATE_STEP);
+
+	if (ht->entries + ht->deleted_entries + 1 > hash_max_load(ht->size)) {
+		/* Grow when at least half full with the entries still
+		 * in the old table, otherwise only drop the tombstones. */
+		entries = ht->entries + ht->old_entries + 1;
+		new_size = ht->size;
+		if (entries > ht->size / 2)
+			new_size *= 2;
+
+		if (new_size == 0 || hash_table_resize(ht, new_size) < 0) {
+			/* Keep going while there is room at all */
+			if (ht->entries + ht->deleted_entries + 1 >= ht->size)
+				return -1;
 		}
+	}
 
-		double_hash = 1 + hash % ht->rehash;
-
-		hash_address = (hash_address + double_hash) % ht->size;
-	} while (hash_address != hash % ht->size);
+	table_insert(ht, hash, data);
 
-	/* We could hit here if a required resize failed. An unchecked-malloc
-	 * application could ignore this result.
-	 */
-	return -1;
+	return 0;
 }
 
 /**
  * This function deletes the given hash table entry.
  *
- * Note that deletion doesn't otherwise modify the table, so an iteration over
- * the table deleting entries is safe.
+ * Note that deletion doesn't move entries during an iteration, so an
+ * iteration over the table deleting entries is safe.
  */
 void
 hash_table_remove(struct hash_table *ht, uint32_t hash)
 {
 	struct hash_entry *entry;
 
-	entry = hash_table_search(ht, hash);
+	if (!ht->iterating)
+		hash_table_migrate(ht, HASH_MIGRATE_STEP);
+
+	entry = table_search(ht->table, ht->size, ht->shift, hash);
 	if (entry != NULL) {
-		entry->data = (void *) &deleted_data;
+		ht->deleted_entries +=
+			table_remove_entry(ht->table, ht->size, entry);
 		ht->entries--;
-		ht->deleted_entries++;
+		return;
+	}
+
+	if (ht->old_table == NULL)
+		return;
+
+	entry = table_search(ht->old_table, ht->old_size, ht->old_shift, hash);
+	if (entry != NULL) {
+		table_remove_entry(ht->old_table, ht->old_size, entry);
+		ht->old_entries--;
 	}
 }
@@ -26,13 +26,70 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include "xwayland.h"
 
+/* X selection data is read from the property in pieces of this size,
+ * the next one requested while the previous is written out, so large
+ * transfers take at most two pieces of memory. */
+#define SELECTION_PIECE_SIZE (64 * 1024)
+
+static void
+weston_wm_request_property_piece(struct weston_wm *wm)
+{
+	/* Without INCR the property goes away with its last piece, an
+	 * INCR chunk is only deleted once written, to ask for the next
+	 * one. */
+	wm->property_cookie =
+		xcb_get_property(wm->conn,
+				 !wm->incr, /* delete */
+				 wm->selection_window,
+				 wm->atom.wl_selection,
+				 XCB_GET_PROPERTY_TYPE_ANY,
+				 wm->property_offset,
+				 SELECTION_PIECE_SIZE / 4 /* length */);
+	wm->property_pending = 1;
+	xcb_flush(wm->conn);
+}
+
+/* Makes reply the piece being written and requests the one after it */
+static void
+weston_wm_set_property_piece(struct weston_wm *wm,
+			     xcb_get_property_reply_t *reply)
+{
+	wm->property_start = 0;
+	wm->property_reply = reply;
+	wm->property_offset += xcb_get_property_value_length(reply) / 4;
+
+	if (reply->bytes_after > 0)
+		weston_wm_request_property_piece(wm);
+}
+
+static void
+weston_wm_property_done(struct weston_wm *wm, int fd)
+{
+	if (wm->property_source) {
+		wl_event_source_remove(wm->property_source);
+		wm->property_source = NULL;
+	}
+
+	if (wm->incr) {
+		xcb_delete_property(wm->conn,
+				    wm->selection_window,
+				    wm->atom.wl_selection);
+		xcb_flush(wm->conn);
+	} else {
+		weston_log("transfer complete\n");
+		close(fd);
+	}
+}
+
 static int
 writable_callback(int fd, uint32_t mask, void *data)
 {
 	struct weston_wm *wm = data;
+	xcb_get_property_reply_t *reply;
 	unsigned char *property;
 	int len, remainder;
 
@@ -41,45 +98,54 @@ writable_callback(int fd, uint32_t mask, void *data)
 		wm->property_start;
 
 	len = write(fd, property + wm->property_start, remainder);
+	if (len == -1 && errno == EAGAIN)
+		return 1;
 	if (len == -1) {
 		free(wm->property_reply);
 		wm->property_reply = NULL;
-		if (wm->property_source)
+		if (wm->property_pending) {
+			xcb_discard_reply(wm->conn,
+					  wm->property_cookie.sequence);
+			wm->property_pending = 0;
+		}
+		if (wm->property_source) {
 			wl_event_source_remove(wm->property_source);
+			wm->property_source = NULL;
+		}
 		close(fd);
 		weston_log("write error to target fd: %m\n");
 		return 1;
 	}
 
-	weston_log("wrote %d (chunk size %d) of %d bytes\n",
-		wm->property_start + len,
-		len, xcb_get_property_value_length(wm->property_reply));
-
 	wm->property_start += len;
-	if (len == remainder) {
-		free(wm->property_reply);
-		wm->property_reply = NULL;
-		if (wm->property_source)
-			wl_event_source_remove(wm->property_source);
+	if (len < remainder)
+		return 1;
 
-		if (wm->incr) {
-			xcb_delete_property(wm->conn,
-					    wm->selection_window,
-					    wm->atom.wl_selection);
-		} else {
-			weston_log("transfer complete\n");
-			close(fd);
+	free(wm->property_reply);
+	wm->property_reply = NULL;
+
+	/* The reader has taken the whole piece, only now move on to the
+	 * next, which was requested while this one was written. */
+	if (wm->property_pending) {
+		wm->property_pending = 0;
+		reply = xcb_get_property_reply(wm->conn,
+					       wm->property_cookie, NULL);
+		if (reply && xcb_get_property_value_length(reply) > 0) {
+			weston_wm_set_property_piece(wm, reply);
+			return 1;
 		}
+		free(reply);
 	}
 
+	weston_wm_property_done(wm, fd);
+
 	return 1;
 }
 
 static void
 weston_wm_write_property(struct weston_wm *wm, xcb_get_property_reply_t *reply)
 {
-	wm->property_start = 0;
-	wm->property_reply = reply;
+	weston_wm_set_property_piece(wm, reply);
 	writable_callback(wm->data_source_fd, WL_EVENT_WRITABLE, wm);
 
 	if (wm->property_reply)
@@ -93,22 +159,16 @@ weston_wm_write_property(struct weston_wm *wm, xcb_get_property_reply_t *reply)
 static void
 weston_wm_get_incr_chunk(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 
-	cookie = xcb_get_property(wm->conn,
-				  0, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	wm->property_offset = 0;
+	weston_wm_request_property_piece(wm);
+	wm->property_pending = 0;
+	reply = xcb_get_property_reply(wm->conn, wm->property_cookie, NULL);
 
 	dump_property(wm, wm->atom.wl_selection, reply);
 
-	if (xcb_get_property_value_length(reply) > 0) {
+	if (reply && xcb_get_property_value_length(reply) > 0) {
 		weston_wm_write_property(wm, reply);
 	} else {
 		weston_log("transfer complete\n");
@@ -215,18 +275,17 @@ weston_wm_get_selection_targets(struct weston_wm *wm)
 static void
 weston_wm_get_selection_data(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 
-	cookie = xcb_get_property(wm->conn,
-				  1, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	/* The INCR marker is deleted right away, which starts the
+	 * transfer of the first chunk. */
+	wm->incr = 0;
+	wm->property_offset = 0;
+	weston_wm_request_property_piece(wm);
+	wm->property_pending = 0;
+	reply = xcb_get_property_reply(wm->conn, wm->property_cookie, NULL);
+	if (reply == NULL)
+		return;
 
 	if (reply->type == wm->atom.incr) {
 		dump_property(wm, wm->atom.wl_selection, reply);
@@ -348,16 +407,21 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 	available = wm->source_data.alloc - current;
 
 	len = read(fd, p, available);
+	if (len == -1 && errno == EAGAIN) {
+		wm->source_data.size = current;
+		return 1;
+	}
 	if (len == -1) {
 		weston_log("read error from data source: %m\n");
 		weston_wm_send_selection_notify(wm, XCB_ATOM_NONE);
 		wl_event_source_remove(wm->property_source);
 		close(fd);
 		wl_array_release(&wm->source_data);
+		return 1;
 	}
 
-	weston_log("read %d (available %d, mask 0x%x) bytes: \"%.*s\"\n",
-		len, available, mask, len, (char *) p);
+	weston_log("read %d (available %d, mask 0x%x) bytes\n",
+		len, available, mask);
 
 	wm->source_data.size = current + len;
 	if (wm->source_data.size >= incr_chunk_size) {
@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <xcb/xcbext.h>
 #include <X11/Xcursor/Xcursor.h>
 #include <linux/input.h>
 
@@ -128,7 +129,12 @@ struct weston_wm_window {
 	struct wl_listener surface_destroy_listener;
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
-	int properties_dirty;
+	/* Bits index wm->properties: changed and not requested yet, and
+	 * requested with the reply not processed yet. */
+	uint32_t properties_dirty;
+	uint32_t properties_pending;
+	xcb_get_property_cookie_t property_cookies[WM_NUM_PROPERTIES];
+	struct wl_list property_link;
 	int pid;
 	char *machine;
 	char *class;
@@ -294,10 +300,13 @@ xcb_cursor_library_load_cursor(struct weston_wm *wm, const char *file)
 	return cursor;
 }
 
+/* Looking up the atom names takes round trips, skip it unless the
+ * log is going to show them. */
 void
 dump_property(struct weston_wm *wm,
 	      xcb_atom_t property, xcb_get_property_reply_t *reply)
 {
+#ifdef WM_DEBUG
 	int32_t *incr_value;
 	const char *text_value, *name;
 	xcb_atom_t *atom_value;
@@ -344,8 +353,10 @@ dump_property(struct weston_wm *wm,
 	} else {
 		wm_log_continue("huh?\n");
 	}
+#endif
 }
 
+#ifdef WM_DEBUG
 static void
 read_and_dump_property(struct weston_wm *wm,
 		       xcb_window_t window, xcb_atom_t property)
@@ -361,6 +372,7 @@ read_and_dump_property(struct weston_wm *wm,
 
 	free(reply);
 }
+#endif
 
 /* We reuse some predefined, but otherwise useles atoms */
 #define TYPE_WM_PROTOCOLS	XCB_ATOM_CUT_BUFFER0
@@ -369,18 +381,10 @@ read_and_dump_property(struct weston_wm *wm,
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_init_properties(struct weston_wm *wm)
 {
-	struct weston_wm *wm = window->wm;
-	struct weston_shell_interface *shell_interface =
-		&wm->server->compositor->shell_interface;
-
 #define F(field) offsetof(struct weston_wm_window, field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		int offset;
-	} props[] = {
+	const struct weston_wm_property props[WM_NUM_PROPERTIES] = {
 		{ XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, F(class) },
 		{ XCB_ATOM_WM_NAME, XCB_ATOM_STRING, F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, F(transient_for) },
@@ -395,104 +399,242 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
-	xcb_get_property_reply_t *reply;
+	memcpy(wm->properties, props, sizeof props);
+	wl_list_init(&wm->property_window_list);
+}
+
+static uint32_t
+weston_wm_property_mask(struct weston_wm *wm, xcb_atom_t atom)
+{
+	uint32_t i;
+
+	for (i = 0; i < WM_NUM_PROPERTIES; i++)
+		if (wm->properties[i].atom == atom)
+			return 1 << i;
+
+	return 0;
+}
+
+/* Sends the requests for the dirty properties of the window without
+ * waiting for the replies, so the requests for many windows created
+ * at once go out back to back.
+ */
+static void
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	uint32_t i, dirty;
+
+	/* A property changed again before its reply came back is still
+	 * requested anew, the pending reply may predate the change. */
+	dirty = window->properties_dirty;
+	if (!dirty)
+		return;
+
+	for (i = 0; i < WM_NUM_PROPERTIES; i++) {
+		if (!(dirty & (1 << i)))
+			continue;
+
+		if (window->properties_pending & (1 << i))
+			xcb_discard_reply(wm->conn,
+					  window->property_cookies[i].sequence);
+
+		window->property_cookies[i] =
+			xcb_get_property(wm->conn,
+					 0, /* delete */
+					 window->id,
+					 wm->properties[i].atom,
+					 XCB_ATOM_ANY, 0, 2048);
+	}
+
+	if (!window->properties_pending)
+		wl_list_insert(wm->property_window_list.prev,
+			       &window->property_link);
+	window->properties_pending |= dirty;
+	window->properties_dirty = 0;
+}
+
+static void
+weston_wm_window_discard_properties(struct weston_wm_window *window)
+{
+	uint32_t i;
+
+	if (!window->properties_pending)
+		return;
+
+	for (i = 0; i < WM_NUM_PROPERTIES; i++)
+		if (window->properties_pending & (1 << i))
+			xcb_discard_reply(window->wm->conn,
+					  window->property_cookies[i].sequence);
+
+	window->properties_pending = 0;
+	wl_list_remove(&window->property_link);
+}
+
+/* Applies one property reply, reply is NULL if the property is not set
+ * or the window is gone. Returns 1 if the window's title changed.
+ */
+static int
+weston_wm_window_apply_property(struct weston_wm_window *window,
+				const struct weston_wm_property *prop,
+				xcb_get_property_reply_t *reply)
+{
+	struct weston_wm *wm = window->wm;
 	void *p;
 	uint32_t *xid;
 	xcb_atom_t *atom;
 	uint32_t i;
 
-	if (!window->properties_dirty)
-		return;
-	window->properties_dirty = 0;
+	/* Properties that go away take their settings with them */
+	switch (prop->type) {
+	case TYPE_WM_PROTOCOLS:
+		window->delete_window = 0;
+		break;
+	case TYPE_WM_NORMAL_HINTS:
+		window->size_hints.flags = 0;
+		break;
+	case TYPE_NET_WM_STATE:
+		window->fullscreen = 0;
+		break;
+	case TYPE_MOTIF_WM_HINTS:
+		window->motif_hints.flags = 0;
+		window->decorate = !window->override_redirect;
+		break;
+	default:
+		break;
+	}
 
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
-
-	window->decorate = !window->override_redirect;
-	window->size_hints.flags = 0;
-	window->motif_hints.flags = 0;
-	window->delete_window = 0;
-
-	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
-		if (!reply)
-			/* Bad window, typically */
-			continue;
-		if (reply->type == XCB_ATOM_NONE) {
-			/* No such property */
-			free(reply);
-			continue;
-		}
+	if (!reply || reply->type == XCB_ATOM_NONE)
+		/* Bad window, typically, or no such property */
+		return 0;
 
-		p = ((char *) window + props[i].offset);
+	p = ((char *) window + prop->offset);
+
+	switch (prop->type) {
+	case XCB_ATOM_WM_CLIENT_MACHINE:
+	case XCB_ATOM_STRING:
+		/* FIXME: We're using this for both string and
+		   utf8_string */
+		if (*(char **) p)
+			free(*(char **) p);
+
+		*(char **) p =
+			strndup(xcb_get_property_value(reply),
+				xcb_get_property_value_length(reply));
+		return prop->offset == offsetof(struct weston_wm_window, name);
+	case XCB_ATOM_WINDOW:
+		xid = xcb_get_property_value(reply);
+		*(struct weston_wm_window **) p =
+			hash_table_lookup(wm->window_hash, *xid);
+		break;
+	case XCB_ATOM_CARDINAL:
+	case XCB_ATOM_ATOM:
+		atom = xcb_get_property_value(reply);
+		*(xcb_atom_t *) p = *atom;
+		break;
+	case TYPE_WM_PROTOCOLS:
+		atom = xcb_get_property_value(reply);
+		for (i = 0; i < reply->value_len; i++)
+			if (atom[i] == wm->atom.wm_delete_window)
+				window->delete_window = 1;
+		break;
+	case TYPE_WM_NORMAL_HINTS:
+		memcpy(&window->size_hints,
+		       xcb_get_property_value(reply),
+		       sizeof window->size_hints);
+		break;
+	case TYPE_NET_WM_STATE:
+		atom = xcb_get_property_value(reply);
+		for (i = 0; i < reply->value_len; i++)
+			if (atom[i] == wm->atom.net_wm_state_fullscreen)
+				window->fullscreen = 1;
+		break;
+	case TYPE_MOTIF_WM_HINTS:
+		memcpy(&window->motif_hints,
+		       xcb_get_property_value(reply),
+		       sizeof window->motif_hints);
+		if (window->motif_hints.flags & MWM_HINTS_DECORATIONS)
+			window->decorate =
+				window->motif_hints.decorations > 0;
+		break;
+	default:
+		break;
+	}
 
-		switch (props[i].type) {
-		case XCB_ATOM_WM_CLIENT_MACHINE:
-		case XCB_ATOM_STRING:
-			/* FIXME: We're using this for both string and
-			   utf8_string */
-			if (*(char **) p)
-				free(*(char **) p);
+	return 0;
+}
 
-			*(char **) p =
-				strndup(xcb_get_property_value(reply),
-					xcb_get_property_value_length(reply));
-			break;
-		case XCB_ATOM_WINDOW:
-			xid = xcb_get_property_value(reply);
-			*(struct weston_wm_window **) p =
-				hash_table_lookup(wm->window_hash, *xid);
-			break;
-		case XCB_ATOM_CARDINAL:
-		case XCB_ATOM_ATOM:
-			atom = xcb_get_property_value(reply);
-			*(xcb_atom_t *) p = *atom;
-			break;
-		case TYPE_WM_PROTOCOLS:
-			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.wm_delete_window)
-					window->delete_window = 1;
-			break;
+/* Processes the property replies of the window that have arrived, or
+ * all of them when wait is set. */
+static void
+weston_wm_window_collect_properties(struct weston_wm_window *window,
+				    int wait)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_shell_interface *shell_interface =
+		&wm->server->compositor->shell_interface;
+	xcb_get_property_reply_t *reply;
+	xcb_generic_error_t *error;
+	int title_changed = 0;
+	uint32_t i;
 
-			break;
-		case TYPE_WM_NORMAL_HINTS:
-			memcpy(&window->size_hints,
-			       xcb_get_property_value(reply),
-			       sizeof window->size_hints);
-			break;
-		case TYPE_NET_WM_STATE:
-			window->fullscreen = 0;
-			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
-					window->fullscreen = 1;
-			break;
-		case TYPE_MOTIF_WM_HINTS:
-			memcpy(&window->motif_hints,
-			       xcb_get_property_value(reply),
-			       sizeof window->motif_hints);
-			if (window->motif_hints.flags & MWM_HINTS_DECORATIONS)
-				window->decorate =
-					window->motif_hints.decorations > 0;
-			break;
-		default:
-			break;
+	for (i = 0; i < WM_NUM_PROPERTIES; i++) {
+		if (!(window->properties_pending & (1 << i)))
+			continue;
+
+		if (wait) {
+			reply = xcb_get_property_reply(wm->conn,
+						       window->property_cookies[i],
+						       NULL);
+		} else {
+			if (!xcb_poll_for_reply(wm->conn,
+						window->property_cookies[i].sequence,
+						(void **) &reply, &error))
+				continue;
+			free(error);
 		}
+
+		window->properties_pending &= ~(1 << i);
+		title_changed |= weston_wm_window_apply_property(window,
+							&wm->properties[i],
+							reply);
 		free(reply);
 	}
 
-	if (window->shsurf && window->name)
+	if (!window->properties_pending)
+		wl_list_remove(&window->property_link);
+
+	if (title_changed && window->shsurf && window->name)
 		shell_interface->set_title(window->shsurf, window->name);
-	if (window->frame && window->name)
+	if (title_changed && window->frame && window->name)
 		frame_set_title(window->frame, window->name);
 }
 
+/* Called from the event loop once the events read are handled */
+static void
+weston_wm_process_property_replies(struct weston_wm *wm)
+{
+	struct weston_wm_window *window, *next;
+
+	wl_list_for_each_safe(window, next,
+			      &wm->property_window_list, property_link)
+		weston_wm_window_collect_properties(window, 0);
+}
+
+/* Brings the window's properties up to date, waiting for the replies
+ * still outstanding. Those were usually requested well before, when
+ * the window was created or the property changed, so this rarely
+ * waits for a round trip.
+ */
+static void
+weston_wm_window_read_properties(struct weston_wm_window *window)
+{
+	weston_wm_window_fetch_properties(window);
+
+	if (window->properties_pending)
+		weston_wm_window_collect_properties(window, 1);
+}
+
 static void
 weston_wm_window_get_frame_size(struct weston_wm_window *window,
 				int *width, int *height)
@@ -1058,14 +1200,24 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	if (!window)
 		return;
 
-	window->properties_dirty = 1;
+	/* Only refetch what we track, the reply is handled once it
+	 * arrives or when the window needs its properties. */
+	window->properties_dirty |=
+		weston_wm_property_mask(wm, property_notify->atom);
+	/* _NET_WM_NAME overrides WM_NAME, so apply it again after */
+	if (property_notify->atom == XCB_ATOM_WM_NAME)
+		window->properties_dirty |=
+			weston_wm_property_mask(wm, wm->atom.net_wm_name);
+	weston_wm_window_fetch_properties(window);
 
+#ifdef WM_DEBUG
 	wm_log("XCB_PROPERTY_NOTIFY: window %d, ", property_notify->window);
 	if (property_notify->state == XCB_PROPERTY_DELETE)
 		wm_log("deleted\n");
 	else
 		read_and_dump_property(wm, property_notify->window,
 				       property_notify->atom);
+#endif
 
 	if (property_notify->atom == wm->atom.net_wm_name ||
 	    property_notify->atom == XCB_ATOM_WM_NAME)
@@ -1094,7 +1246,7 @@ weston_wm_window_create(struct weston_wm *wm,
 
 	window->wm = wm;
 	window->id = id;
-	window->properties_dirty = 1;
+	window->properties_dirty = (1 << WM_NUM_PROPERTIES) - 1;
 	window->override_redirect = override;
 	window->width = width;
 	window->height = height;
@@ -1109,6 +1261,9 @@ weston_wm_window_create(struct weston_wm *wm,
 	free(geometry_reply);
 
 	hash_table_insert(wm->window_hash, id, window);
+
+	/* Get the replies on their way before the window is mapped */
+	weston_wm_window_fetch_properties(window);
 }
 
 static void
@@ -1121,6 +1276,8 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 	if (window->cairo_surface)
 		cairo_surface_destroy(window->cairo_surface);
 
+	weston_wm_window_discard_properties(window);
+
 	if (window->frame_id) {
 		xcb_reparent_window(wm->conn, window->id, wm->wm_window, 0, 0);
 		xcb_destroy_window(wm->conn, window->frame_id);
@@ -1789,6 +1946,8 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 		count++;
 	}
 
+	weston_wm_process_property_replies(wm);
+
 	xcb_flush(wm->conn);
 
 	return count;
@@ -2053,6 +2212,7 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	wl_event_source_check(wm->source);
 
 	weston_wm_get_resources(wm);
+	weston_wm_init_properties(wm);
 	weston_wm_get_visual_and_colormap(wm);
 
 	values[0] =
@@ -50,6 +50,16 @@ struct weston_xserver {
 	struct wl_listener destroy_listener;
 };
 
+/* The window properties the window manager tracks, see
+ * weston_wm_window_read_properties() */
+#define WM_NUM_PROPERTIES 11
+
+struct weston_wm_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	int offset;		/* into struct weston_wm_window */
+};
+
 struct weston_wm {
 	xcb_connection_t *conn;
 	const xcb_query_extension_reply_t *xfixes;
@@ -71,6 +81,9 @@ struct weston_wm {
 	struct wl_listener kill_listener;
 	struct wl_list unpaired_window_list;
 
+	struct weston_wm_property properties[WM_NUM_PROPERTIES];
+	struct wl_list property_window_list;	/* replies outstanding */
+
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;
 	int incr;
@@ -78,6 +91,9 @@ struct weston_wm {
 	struct wl_event_source *property_source;
 	xcb_get_property_reply_t *property_reply;
 	int property_start;
+	uint32_t property_offset;	/* of the next piece, in 32 bit units */
+	xcb_get_property_cookie_t property_cookie;
+	int property_pending;
 	struct wl_array source_data;
 	xcb_selection_request_event_t selection_request;
 	xcb_atom_t selection_target;